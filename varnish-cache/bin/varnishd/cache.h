@@ -94,6 +94,8 @@ struct vrt_backend;
 struct cli_proto;
 struct ban;
 struct SHA256Context;
+struct varnish_dirstat;
+struct vbe_pipeline;
 
 struct smp_object;
 struct smp_seg;
@@ -201,6 +203,10 @@ struct worker {
 	struct objcore		*nobjcore;
 	struct dstat		*stats;
 
+	/* Cached vbe_conns, see VBE_NewConn() */
+	VTAILQ_HEAD(vbe_connhead, vbe_conn) vbe_conns;
+	unsigned		nvbe_conn;
+
 	double			lastused;
 
 	pthread_cond_t		cond;
@@ -250,6 +256,8 @@ struct workreq {
 	VTAILQ_ENTRY(workreq)	list;
 	workfunc		*func;
 	void			*priv;
+	double			t_queue;
+	unsigned		pool;	/* last ran in pool - 1, or 0 */
 };
 
 /* Storage -----------------------------------------------------------*/
@@ -392,6 +400,7 @@ struct sess {
 	unsigned		handling;
 	unsigned char		sendbody;
 	unsigned char		wantbody;
+	unsigned char		pipelinable;
 	int			err_code;
 	const char		*err_reason;
 
@@ -432,6 +441,19 @@ struct vbe_conn {
 	VTAILQ_ENTRY(vbe_conn)	list;
 	struct backend		*backend;
 	int			fd;
+	struct varnish_dirstat	*dirstat;
+
+	/* See cache_backend_idle.c */
+	unsigned		idle;
+	unsigned		waited;
+	unsigned		hup;
+	double			t_idle;
+
+	/* See cache_backend_pipeline.c */
+	struct vbe_pipeline	*pipeline;
+	unsigned		seq;
+	unsigned		reading;
+	unsigned		proven;
 };
 
 /* Prototypes etc ----------------------------------------------------*/
@@ -449,15 +471,24 @@ void VBE_GetFd(struct sess *sp);
 void VBE_ClosedFd(struct sess *sp);
 void VBE_RecycleFd(struct sess *sp);
 void VBE_AddHostHeader(const struct sess *sp);
+void VBE_UpdateTtfb(const struct vbe_conn *vc, double ttfb);
+void VBE_UpdateErr(const struct vbe_conn *vc, int err);
+void VBE_Cleanup(struct worker *w);
 void VBE_Poll(void);
 
 /* cache_backend_cfg.c */
 void VBE_Init(void);
 struct backend *VBE_AddBackend(struct cli *cli, const struct vrt_backend *vb);
 
+/* cache_backend_idle.c */
+void VBI_Init(void);
+
 /* cache_backend_poll.c */
 void VBP_Init(void);
 
+/* cache_backend_resolve.c */
+void VBR_Init(void);
+
 /* cache_ban.c */
 struct ban *BAN_New(void);
 int BAN_AddTest(struct cli *, struct ban *, const char *, const char *, const char *);
@@ -564,6 +595,7 @@ void Lck__Assert(const struct lock *lck, int held);
 void LCK_Init(void);
 void Lck_Delete(struct lock *lck);
 void Lck_CondWait(pthread_cond_t *cond, struct lock *lck);
+int Lck_CondTimedWait(pthread_cond_t *cond, struct lock *lck, double when);
 
 #define Lck_New(a) Lck__New(a, #a);
 #define Lck_Lock(a) Lck__Lock(a, __func__, __FILE__, __LINE__)
@@ -572,6 +604,19 @@ void Lck_CondWait(pthread_cond_t *cond, struct lock *lck);
 #define Lck_AssertHeld(a) Lck__Assert(a, 1)
 #define Lck_AssertNotHeld(a) Lck__Assert(a, 0)
 
+/*
+ * Atomic counters, for things which are updated too often to be worth
+ * taking a lock for.  Both return the new value.
+ */
+#ifdef HAVE_SYNC_BUILTINS
+#define Atomic_Inc(p) __sync_add_and_fetch(p, 1)
+#define Atomic_Dec(p) __sync_sub_and_fetch(p, 1)
+#else
+unsigned Lck__AtomicAdd(volatile unsigned *p, int d);
+#define Atomic_Inc(p) Lck__AtomicAdd(p, 1)
+#define Atomic_Dec(p) Lck__AtomicAdd(p, -1)
+#endif
+
 /* cache_panic.c */
 void PAN_Init(void);
 
@@ -607,6 +652,9 @@ void SES_InheritBackendTimeouts(struct sess *sp);
 
 /* cache_shmlog.c */
 void VSL_Init(void);
+struct varnish_dirstat *VSL_DirStatNew(const char *director,
+    const char *backend);
+void VSL_DirStatDel(struct varnish_dirstat *ds);
 #ifdef SHMLOGHEAD_MAGIC
 void VSL(enum shmlogtag tag, int id, const char *fmt, ...);
 void WSLR(struct worker *w, enum shmlogtag tag, int id, txt t);
@@ -35,6 +35,7 @@
 #include "svnid.h"
 SVNID("$Id$")
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,6 +68,85 @@ VBE_AddHostHeader(const struct sess *sp)
 	    "Host: %s", sp->vbe->backend->hosthdr);
 }
 
+/*--------------------------------------------------------------------
+ * Fold the time it took to get the response headers of a fetch into
+ * the backend's exponential average.
+ */
+
+/* Averaging rate, somewhat slower than the probes as we get many more */
+#define TTFB_AVG_RATE			8
+
+void
+VBE_UpdateTtfb(const struct vbe_conn *vc, double ttfb)
+{
+	struct backend *bp;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	bp = vc->backend;
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+
+	Lck_Lock(&bp->mtx);
+	if (bp->ttfb_rate < TTFB_AVG_RATE)
+		bp->ttfb_rate += 1.0;
+	bp->ttfb_avg += (ttfb - bp->ttfb_avg) / bp->ttfb_rate;
+	Lck_Unlock(&bp->mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Passive health: keep track of how many of the recent fetches from a
+ * backend failed to connect, timed out or got a 5xx response, so that
+ * directors can stop using it long before the probe notices.
+ *
+ * Unlike the time to first byte, there is no warm-up, a single error
+ * on a new backend should not count as an error rate of 100%.
+ */
+
+#define ERR_AVG_RATE			8
+
+static void
+vbe_update_err(struct backend *bp, int err)
+{
+
+	Lck_Lock(&bp->mtx);
+	bp->err_avg += ((err ? 1.0 : 0.0) - bp->err_avg) / ERR_AVG_RATE;
+	if (err)
+		bp->t_err = TIM_real();
+	Lck_Unlock(&bp->mtx);
+}
+
+void
+VBE_UpdateErr(const struct vbe_conn *vc, int err)
+{
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	CHECK_OBJ_NOTNULL(vc->backend, BACKEND_MAGIC);
+	vbe_update_err(vc->backend, err);
+}
+
+/*--------------------------------------------------------------------
+ * Log a new backend connection.
+ *
+ * Connections opened outside any session (w == NULL) are logged with
+ * VSL() instead.
+ */
+
+static void
+vbe_log_open(struct worker *w, int s, const struct sockaddr *sa,
+    socklen_t salen, const struct backend *bp)
+{
+	char abuf1[TCP_ADDRBUFSIZE], abuf2[TCP_ADDRBUFSIZE];
+	char pbuf1[TCP_PORTBUFSIZE], pbuf2[TCP_PORTBUFSIZE];
+
+	TCP_myname(s, abuf1, sizeof abuf1, pbuf1, sizeof pbuf1);
+	TCP_name(sa, salen, abuf2, sizeof abuf2, pbuf2, sizeof pbuf2);
+	if (w != NULL)
+		WSL(w, SLT_BackendOpen, s, "%s %s %s %s %s",
+		    bp->vcl_name, abuf1, pbuf1, abuf2, pbuf2);
+	else
+		VSL(SLT_BackendOpen, s, "%s %s %s %s %s",
+		    bp->vcl_name, abuf1, pbuf1, abuf2, pbuf2);
+}
+
 /*--------------------------------------------------------------------
  * Attempt to connect to a given addrinfo entry.
  *
@@ -77,23 +157,15 @@ VBE_AddHostHeader(const struct sess *sp)
  */
 
 static int
-VBE_TryConnect(const struct sess *sp, int pf, const struct sockaddr *sa,
-    socklen_t salen, const struct backend *bp)
+VBE_TryConnect(struct worker *w, int pf, const struct sockaddr *sa,
+    socklen_t salen, const struct backend *bp, int tmo)
 {
-	int s, i, tmo;
-	char abuf1[TCP_ADDRBUFSIZE], abuf2[TCP_ADDRBUFSIZE];
-	char pbuf1[TCP_PORTBUFSIZE], pbuf2[TCP_PORTBUFSIZE];
-
-	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	int s, i;
 
 	s = socket(pf, SOCK_STREAM, 0);
 	if (s < 0)
 		return (s);
 
-	tmo = (int)(sp->connect_timeout * 1000);
-	if (bp->connect_timeout > 10e-3)
-		tmo = (int)(bp->connect_timeout * 1000);
-
 	if (tmo > 0)
 		i = TCP_connect(s, sa, salen, tmo);
 	else
@@ -104,20 +176,190 @@ VBE_TryConnect(const struct sess *sp, int pf, const struct sockaddr *sa,
 		return (-1);
 	}
 
-	TCP_myname(s, abuf1, sizeof abuf1, pbuf1, sizeof pbuf1);
-	TCP_name(sa, salen, abuf2, sizeof abuf2, pbuf2, sizeof pbuf2);
-	WSL(sp->wrk, SLT_BackendOpen, s, "%s %s %s %s %s",
-	    bp->vcl_name, abuf1, pbuf1, abuf2, pbuf2);
-
+	vbe_log_open(w, s, sa, salen, bp);
 	return (s);
 }
 
+/*--------------------------------------------------------------------
+ * Connect to a backend with both IPv4 and IPv6 addresses, without
+ * paying the full connect timeout when one of them is black-holed.
+ *
+ * We start a non-blocking connect to the preferred address, and if it
+ * has not succeeded within HAPPY_EYEBALLS_DELAY, or it fails, we start
+ * one to the other address as well, and use whichever connects first.
+ * (RFC 6555, "Happy Eyeballs")
+ */
+
+#define HAPPY_EYEBALLS_DELAY	0.25
+
+struct vbe_attempt {
+	int			pf;
+	const struct sockaddr	*sa;
+	socklen_t		salen;
+	int			fd;
+};
+
+static int
+vbe_attempt_start(struct vbe_attempt *a)
+{
+
+	a->fd = socket(a->pf, SOCK_STREAM, 0);
+	if (a->fd < 0)
+		return (-1);
+	TCP_nonblocking(a->fd);
+	if (connect(a->fd, a->sa, a->salen) == 0)
+		return (1);
+	if (errno == EINPROGRESS)
+		return (0);
+	AZ(close(a->fd));
+	a->fd = -1;
+	return (-1);
+}
+
+static int
+vbe_happy_eyeballs(struct worker *w, const struct backend *bp, int tmo,
+    const struct sockaddr *sa4, socklen_t sa4len,
+    const struct sockaddr *sa6, socklen_t sa6len)
+{
+	struct vbe_attempt a[2];
+	struct pollfd pfd[2];
+	int ai[2];
+	double t0, now, t_next;
+	int i, j, k, n, ms, started, win;
+	socklen_t l;
+
+	a[0].pf = PF_INET6;
+	a[0].sa = sa6;
+	a[0].salen = sa6len;
+	a[1].pf = PF_INET;
+	a[1].sa = sa4;
+	a[1].salen = sa4len;
+	if (!params->prefer_ipv6) {
+		a[1] = a[0];
+		a[0].pf = PF_INET;
+		a[0].sa = sa4;
+		a[0].salen = sa4len;
+	}
+	a[0].fd = a[1].fd = -1;
+
+	t0 = TIM_real();
+	t_next = t0;
+	started = 0;
+	win = -1;
+	while (win == -1) {
+		now = TIM_real();
+		if (tmo > 0 && (now - t0) * 1e3 >= tmo)
+			break;
+
+		/* Start the next attempt if it is time, or the first failed */
+		if (started < 2 && (now >= t_next || a[0].fd < 0)) {
+			i = vbe_attempt_start(&a[started]);
+			if (i == 1)
+				win = started;
+			started++;
+			t_next = now + HAPPY_EYEBALLS_DELAY;
+			continue;
+		}
+
+		n = 0;
+		for (j = 0; j < started; j++) {
+			if (a[j].fd < 0)
+				continue;
+			pfd[n].fd = a[j].fd;
+			pfd[n].events = POLLWRNORM;
+			pfd[n].revents = 0;
+			ai[n++] = j;
+		}
+		if (n == 0)
+			break;
+
+		ms = -1;
+		if (started < 2)
+			ms = (int)((t_next - now) * 1e3) + 1;
+		if (tmo > 0) {
+			k = tmo - (int)((now - t0) * 1e3);
+			if (ms == -1 || k < ms)
+				ms = k;
+		}
+		if (poll(pfd, n, ms) <= 0)
+			continue;
+
+		for (j = 0; j < n && win == -1; j++) {
+			if (pfd[j].revents == 0)
+				continue;
+			l = sizeof k;
+			AZ(getsockopt(pfd[j].fd, SOL_SOCKET, SO_ERROR, &k, &l));
+			if (k == 0) {
+				win = ai[j];
+				continue;
+			}
+			AZ(close(a[ai[j]].fd));
+			a[ai[j]].fd = -1;
+		}
+	}
+
+	for (j = 0; j < started; j++)
+		if (j != win && a[j].fd >= 0)
+			AZ(close(a[j].fd));
+	if (win == -1)
+		return (-1);
+	TCP_blocking(a[win].fd);
+	vbe_log_open(w, a[win].fd, a[win].sa, a[win].salen, bp);
+	return (a[win].fd);
+}
+
+/*--------------------------------------------------------------------
+ * Open a connection to a backend, racing the address families if it
+ * has both.
+ *
+ * The addresses may be replaced when the backend is looked up again
+ * (see cache_backend_resolve.c), so we work on a copy of them.
+ */
+
+static int
+vbe_open(struct worker *w, struct backend *bp, double connect_timeout)
+{
+	struct sockaddr_storage ss4, ss6;
+	socklen_t l4, l6;
+	int tmo;
+
+	l4 = l6 = 0;
+	Lck_Lock(&bp->mtx);
+	assert(bp->ipv6 != NULL || bp->ipv4 != NULL);
+	if (bp->ipv4 != NULL) {
+		assert(bp->ipv4len <= sizeof ss4);
+		l4 = bp->ipv4len;
+		memcpy(&ss4, bp->ipv4, l4);
+	}
+	if (bp->ipv6 != NULL) {
+		assert(bp->ipv6len <= sizeof ss6);
+		l6 = bp->ipv6len;
+		memcpy(&ss6, bp->ipv6, l6);
+	}
+	Lck_Unlock(&bp->mtx);
+
+	tmo = (int)(connect_timeout * 1000);
+	if (bp->connect_timeout > 10e-3)
+		tmo = (int)(bp->connect_timeout * 1000);
+
+	if (l4 == 0)
+		return (VBE_TryConnect(w, PF_INET6, (void*)&ss6, l6, bp, tmo));
+	if (l6 == 0)
+		return (VBE_TryConnect(w, PF_INET, (void*)&ss4, l4, bp, tmo));
+	return (vbe_happy_eyeballs(w, bp, tmo,
+	    (void*)&ss4, l4, (void*)&ss6, l6));
+}
+
 /*--------------------------------------------------------------------
  * Check that there is still something at the far end of a given socket.
  * We poll the fd with instant timeout, if there are any events we can't
  * use it (backends are not allowed to pipeline).
+ *
+ * With epoll, cache_backend_idle.c closes idle connections as soon as the
+ * backend does, and the fetch path does not need to check.
  */
 
+#if !defined(HAVE_EPOLL_CTL)
 static int
 VBE_CheckFd(int fd)
 {
@@ -128,18 +370,78 @@ VBE_CheckFd(int fd)
 	pfd.revents = 0;
 	return(poll(&pfd, 1, 0) == 0);
 }
+#endif
 
 /*--------------------------------------------------------------------
  * Manage a pool of vbe_conn structures.
  * XXX: as an experiment, make this caching controled by a parameter
  * XXX: so we can see if it has any effect.
+ *
+ * Each worker thread keeps a few vbe_conns of its own, and moves them
+ * to and from the global pool VBE_CONN_BATCH at a time, so that we do
+ * not take VBE_mtx on every fetch.  Threads which are not workers
+ * (w == NULL) use the global pool directly.
  */
 
+#define VBE_CONN_BATCH		8
+
+static void
+vbe_flush_conns(struct worker *w, unsigned n)
+{
+	struct vbe_conn *vc;
+
+	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	assert(n <= w->nvbe_conn);
+	if (n == 0)
+		return;
+	Lck_Lock(&VBE_mtx);
+	while (n-- > 0) {
+		vc = VTAILQ_LAST(&w->vbe_conns, vbe_connhead);
+		CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+		VTAILQ_REMOVE(&w->vbe_conns, vc, list);
+		w->nvbe_conn--;
+		VTAILQ_INSERT_HEAD(&vbe_conns, vc, list);
+		VSL_stats->backend_unused++;
+	}
+	Lck_Unlock(&VBE_mtx);
+}
+
+static void
+vbe_refill_conns(struct worker *w)
+{
+	struct vbe_conn *vc;
+	unsigned n;
+
+	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	Lck_Lock(&VBE_mtx);
+	for (n = 0; n < VBE_CONN_BATCH; n++) {
+		vc = VTAILQ_FIRST(&vbe_conns);
+		if (vc == NULL)
+			break;
+		VSL_stats->backend_unused--;
+		VTAILQ_REMOVE(&vbe_conns, vc, list);
+		VTAILQ_INSERT_TAIL(&w->vbe_conns, vc, list);
+		w->nvbe_conn++;
+	}
+	Lck_Unlock(&VBE_mtx);
+}
+
 static struct vbe_conn *
-VBE_NewConn(void)
+VBE_NewConn(struct worker *w)
 {
 	struct vbe_conn *vc;
 
+	if (w != NULL) {
+		CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+		if (w->nvbe_conn == 0 && !VTAILQ_EMPTY(&vbe_conns))
+			vbe_refill_conns(w);
+		vc = VTAILQ_FIRST(&w->vbe_conns);
+		if (vc != NULL) {
+			VTAILQ_REMOVE(&w->vbe_conns, vc, list);
+			w->nvbe_conn--;
+			return (vc);
+		}
+	}
 	vc = VTAILQ_FIRST(&vbe_conns);
 	if (vc != NULL) {
 		Lck_Lock(&VBE_mtx);
@@ -161,24 +463,51 @@ VBE_NewConn(void)
 }
 
 void
-VBE_ReleaseConn(struct vbe_conn *vc)
+VBE_ReleaseConn(struct worker *w, struct vbe_conn *vc)
 {
 
 	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
 	assert(vc->backend == NULL);
 	assert(vc->fd < 0);
-
-	if (params->cache_vbe_conns) {
+	AZ(vc->dirstat);
+	AZ(vc->idle);
+	AZ(vc->pipeline);
+	AZ(vc->reading);
+	vc->proven = 0;
+
+	if (vc->waited) {
+		VBI_Bury(vc);
+		return;
+	}
+	if (!params->cache_vbe_conns) {
+		VSL_stats->n_vbe_conn--;
+		free(vc);
+	} else if (w != NULL) {
+		CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+		VTAILQ_INSERT_HEAD(&w->vbe_conns, vc, list);
+		if (++w->nvbe_conn >= 2 * VBE_CONN_BATCH)
+			vbe_flush_conns(w, VBE_CONN_BATCH);
+	} else {
 		Lck_Lock(&VBE_mtx);
 		VTAILQ_INSERT_HEAD(&vbe_conns, vc, list);
 		VSL_stats->backend_unused++;
 		Lck_Unlock(&VBE_mtx);
-	} else {
-		VSL_stats->n_vbe_conn--;
-		free(vc);
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Hand a worker thread's cached vbe_conns back when it goes away.
+ */
+
+void
+VBE_Cleanup(struct worker *w)
+{
+
+	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	vbe_flush_conns(w, w->nvbe_conn);
+	AZ(VTAILQ_FIRST(&w->vbe_conns));
+}
+
 /*--------------------------------------------------------------------*/
 
 static int
@@ -188,24 +517,16 @@ bes_conn_try(const struct sess *sp, struct backend *bp)
 
 	Lck_Lock(&bp->mtx);
 	bp->refcount++;
-	bp->n_conn++;		/* It mostly works */
 	Lck_Unlock(&bp->mtx);
-
-	s = -1;
-	assert(bp->ipv6 != NULL || bp->ipv4 != NULL);
+	(void)Atomic_Inc(&bp->n_conn);
 
 	/* release lock during stuff that can take a long time */
 
-	if (params->prefer_ipv6 && bp->ipv6 != NULL)
-		s = VBE_TryConnect(sp, PF_INET6, bp->ipv6, bp->ipv6len, bp);
-	if (s == -1 && bp->ipv4 != NULL)
-		s = VBE_TryConnect(sp, PF_INET, bp->ipv4, bp->ipv4len, bp);
-	if (s == -1 && !params->prefer_ipv6 && bp->ipv6 != NULL)
-		s = VBE_TryConnect(sp, PF_INET6, bp->ipv6, bp->ipv6len, bp);
+	s = vbe_open(sp->wrk, bp, sp->connect_timeout);
 
 	if (s < 0) {
+		(void)Atomic_Dec(&bp->n_conn);
 		Lck_Lock(&bp->mtx);
-		bp->n_conn--;
 		bp->refcount--;		/* Only keep ref on success */
 		Lck_Unlock(&bp->mtx);
 	}
@@ -229,17 +550,14 @@ VBE_GetFd(struct sess *sp)
 }
 
 /*--------------------------------------------------------------------
- * Get a connection to a particular backend.
+ * Get a connection of our own to a particular backend.
  */
 
-struct vbe_conn *
-VBE_GetVbe(struct sess *sp, struct backend *bp)
+static struct vbe_conn *
+vbe_get_conn(struct sess *sp, struct backend *bp)
 {
 	struct vbe_conn *vc;
 
-	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
-	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
-
 	/* first look for vbe_conn's we can recycle */
 	while (1) {
 		Lck_Lock(&bp->mtx);
@@ -248,21 +566,27 @@ VBE_GetVbe(struct sess *sp, struct backend *bp)
 			bp->refcount++;
 			assert(vc->backend == bp);
 			assert(vc->fd >= 0);
+			AN(vc->idle);
 			VTAILQ_REMOVE(&bp->connlist, vc, list);
+			vc->idle = 0;
 		}
 		Lck_Unlock(&bp->mtx);
 		if (vc == NULL)
 			break;
-		if (VBE_CheckFd(vc->fd)) {
-			/* XXX locking of stats */
-			VSL_stats->backend_reuse += 1;
-			VSL_stats->backend_conn++;
-			WSP(sp, SLT_Backend, "%d %s %s",
-			    vc->fd, sp->director->vcl_name, bp->vcl_name);
-			return (vc);
+#if !defined(HAVE_EPOLL_CTL)
+		/* Without epoll, the idle reaper does not see them close */
+		if (!VBE_CheckFd(vc->fd)) {
+			sp->vbe = vc;
+			VBE_ClosedFd(sp);
+			continue;
 		}
-		sp->vbe = vc;
-		VBE_ClosedFd(sp);
+#endif
+		/* XXX locking of stats */
+		VSL_stats->backend_reuse += 1;
+		VSL_stats->backend_conn++;
+		WSP(sp, SLT_Backend, "%d %s %s",
+		    vc->fd, sp->director->vcl_name, bp->vcl_name);
+		return (vc);
 	}
 
 	if (!bp->healthy) {
@@ -275,13 +599,14 @@ VBE_GetVbe(struct sess *sp, struct backend *bp)
 		return (NULL);
 	}
 
-	vc = VBE_NewConn();
+	vc = VBE_NewConn(sp->wrk);
 	assert(vc->fd == -1);
 	AZ(vc->backend);
 	vc->fd = bes_conn_try(sp, bp);
 	if (vc->fd < 0) {
-		VBE_ReleaseConn(vc);
+		VBE_ReleaseConn(sp->wrk, vc);
 		VSL_stats->backend_fail++;
+		vbe_update_err(bp, 1);
 		return (NULL);
 	}
 	vc->backend = bp;
@@ -291,6 +616,90 @@ VBE_GetVbe(struct sess *sp, struct backend *bp)
 	return (vc);
 }
 
+/*--------------------------------------------------------------------
+ * Get a share of a connection somebody else is pipelining requests on.
+ */
+
+static struct vbe_conn *
+vbe_join_pipeline(struct sess *sp, struct backend *bp)
+{
+	struct vbe_pipeline *pl;
+	struct vbe_conn *vc;
+	unsigned seq;
+
+	pl = VBL_Join(bp, &seq);
+	if (pl == NULL)
+		return (NULL);
+	(void)Atomic_Inc(&bp->n_conn);
+	vc = VBE_NewConn(sp->wrk);
+	assert(vc->fd == -1);
+	AZ(vc->backend);
+	vc->fd = pl->fd;
+	vc->backend = bp;
+	vc->pipeline = pl;
+	vc->seq = seq;
+	VSL_stats->backend_conn++;
+	WSP(sp, SLT_Backend, "%d %s %s",
+	    vc->fd, sp->director->vcl_name, bp->vcl_name);
+	return (vc);
+}
+
+/*--------------------------------------------------------------------
+ * Get a connection to a particular backend.
+ */
+
+struct vbe_conn *
+VBE_GetVbe(struct sess *sp, struct backend *bp)
+{
+	struct vbe_conn *vc;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+
+	if (!sp->pipelinable || bp->pipeline_depth < 2)
+		return (vbe_get_conn(sp, bp));
+	vc = vbe_join_pipeline(sp, bp);
+	if (vc == NULL) {
+		vc = vbe_get_conn(sp, bp);
+		if (vc != NULL)
+			VBL_Start(vc);
+	}
+	return (vc);
+}
+
+/*--------------------------------------------------------------------
+ * A director which keeps statistics for its members marks connections
+ * it hands out, so that we can tell it when they are no longer in use.
+ */
+
+static void
+vbe_dirstat_release(struct vbe_conn *vc)
+{
+
+	if (vc->dirstat == NULL)
+		return;
+	(void)Atomic_Dec(&vc->dirstat->inflight);
+	vc->dirstat = NULL;
+}
+
+/*--------------------------------------------------------------------
+ * Let go of our share of a pipelined connection others still use.
+ */
+
+static void
+vbe_drop_share(struct sess *sp)
+{
+	struct backend *bp;
+
+	bp = sp->vbe->backend;
+	vbe_dirstat_release(sp->vbe);
+	sp->vbe->fd = -1;
+	sp->vbe->backend = NULL;
+	VBE_DropRefConn(bp);
+	VBE_ReleaseConn(sp->wrk, sp->vbe);
+	sp->vbe = NULL;
+}
+
 /* Close a connection ------------------------------------------------*/
 
 void
@@ -302,13 +711,20 @@ VBE_ClosedFd(struct sess *sp)
 	CHECK_OBJ_NOTNULL(sp->vbe->backend, BACKEND_MAGIC);
 	assert(sp->vbe->fd >= 0);
 
+	if (sp->vbe->pipeline != NULL &&
+	    VBL_Release(sp->vbe, sp->wrk->htc, 1) == 0) {
+		vbe_drop_share(sp);
+		return;
+	}
+
 	bp = sp->vbe->backend;
 
 	WSL(sp->wrk, SLT_BackendClose, sp->vbe->fd, "%s", bp->vcl_name);
+	vbe_dirstat_release(sp->vbe);
 	TCP_close(&sp->vbe->fd);
 	VBE_DropRefConn(bp);
 	sp->vbe->backend = NULL;
-	VBE_ReleaseConn(sp->vbe);
+	VBE_ReleaseConn(sp->wrk, sp->vbe);
 	sp->vbe = NULL;
 }
 
@@ -318,17 +734,175 @@ void
 VBE_RecycleFd(struct sess *sp)
 {
 	struct backend *bp;
+	int i;
 
 	CHECK_OBJ_NOTNULL(sp->vbe, VBE_CONN_MAGIC);
 	CHECK_OBJ_NOTNULL(sp->vbe->backend, BACKEND_MAGIC);
 	assert(sp->vbe->fd >= 0);
 
+	if (sp->vbe->pipeline != NULL) {
+		i = VBL_Release(sp->vbe, sp->wrk->htc, 0);
+		if (i == 0) {
+			vbe_drop_share(sp);
+			return;
+		}
+		if (i < 0) {
+			VBE_ClosedFd(sp);
+			return;
+		}
+	}
+
 	bp = sp->vbe->backend;
 
 	WSL(sp->wrk, SLT_BackendReuse, sp->vbe->fd, "%s", bp->vcl_name);
+	vbe_dirstat_release(sp->vbe);
+	VBI_Arm(sp->vbe);
 	Lck_Lock(&bp->mtx);
+	if (sp->vbe->hup) {
+		/* The backend closed it on us */
+		Lck_Unlock(&bp->mtx);
+		VBE_ClosedFd(sp);
+		return;
+	}
 	VSL_stats->backend_recycle++;
+	sp->vbe->idle = 1;
+	sp->vbe->t_idle = TIM_real();
 	VTAILQ_INSERT_HEAD(&bp->connlist, sp->vbe, list);
 	sp->vbe = NULL;
 	VBE_DropRefLocked(bp);
+	VBE_Released();
+}
+
+/*--------------------------------------------------------------------
+ * Keep .min_idle_connections connections to a backend open and idle,
+ * so that requests do not have to wait for the connect.
+ *
+ * A single thread looks after all the backends which want this.  Every
+ * WARM_INTERVAL it opens new connections until there are enough, the
+ * backend is at its .max_connections or it stops answering.  It only
+ * counts the idle connections, finding those the backend closed is the
+ * idle reaper's job.  New connections go at the tail of the list, so
+ * the recently used ones are reused first.
+ */
+
+#define WARM_INTERVAL		0.1
+
+static struct lock vbe_warm_mtx;
+static pthread_cond_t vbe_warm_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t vbe_warm_thr;
+static unsigned vbe_warm_started;
+
+/* Protected by vbe_warm_mtx */
+static VTAILQ_HEAD(, backend) vbe_warm_list =
+    VTAILQ_HEAD_INITIALIZER(vbe_warm_list);
+
+static int
+vbe_warm_one(struct backend *bp)
+{
+	struct vbe_conn *vc;
+	unsigned n;
+	int s;
+
+	n = 0;
+	Lck_Lock(&bp->mtx);
+	VTAILQ_FOREACH(vc, &bp->connlist, list)
+		if (++n >= bp->min_idle)
+			break;
+	Lck_Unlock(&bp->mtx);
+
+	if (!bp->healthy || n >= bp->min_idle)
+		return (0);
+	if (bp->max_conn > 0 && bp->n_conn >= bp->max_conn)
+		return (0);
+
+	(void)Atomic_Inc(&bp->n_conn);
+	s = vbe_open(NULL, bp, params->connect_timeout);
+	if (s < 0) {
+		(void)Atomic_Dec(&bp->n_conn);
+		return (0);
+	}
+	vc = VBE_NewConn(NULL);
+	assert(vc->fd == -1);
+	AZ(vc->backend);
+	vc->fd = s;
+	vc->backend = bp;
+	VBI_Arm(vc);
+	Lck_Lock(&bp->mtx);
+	if (vc->hup) {
+		/* The backend closed it on us */
+		Lck_Unlock(&bp->mtx);
+		VSL(SLT_BackendClose, vc->fd, "%s", bp->vcl_name);
+		TCP_close(&vc->fd);
+		(void)Atomic_Dec(&bp->n_conn);
+		vc->backend = NULL;
+		VBE_ReleaseConn(NULL, vc);
+		return (0);
+	}
+	VSL_stats->backend_warm++;
+	vc->idle = 1;
+	vc->t_idle = TIM_real();
+	VTAILQ_INSERT_TAIL(&bp->connlist, vc, list);
+	Lck_Unlock(&bp->mtx);
+	return (1);
+}
+
+static void *
+vbe_warm_thread(void *priv)
+{
+	struct backend *bp;
+	unsigned n;
+
+	THR_SetName("backend warm");
+	(void)priv;
+	Lck_Lock(&vbe_warm_mtx);
+	while (1) {
+		n = 0;
+		VTAILQ_FOREACH(bp, &vbe_warm_list, warm_list) {
+			CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+			n += vbe_warm_one(bp);
+		}
+		if (n == 0)
+			(void)Lck_CondTimedWait(&vbe_warm_cond, &vbe_warm_mtx,
+			    TIM_real() + WARM_INTERVAL);
+	}
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------
+ * Start/Stop called from cache_backend_cfg.c
+ */
+
+void
+VBE_WarmStart(struct backend *bp)
+{
+
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	ASSERT_CLI();
+	if (bp->min_idle == 0 || bp->warm_running)
+		return;
+	if (!vbe_warm_started) {
+		Lck_New(&vbe_warm_mtx);
+		AZ(pthread_create(&vbe_warm_thr, NULL, vbe_warm_thread, NULL));
+		vbe_warm_started = 1;
+	}
+	Lck_Lock(&vbe_warm_mtx);
+	VTAILQ_INSERT_TAIL(&vbe_warm_list, bp, warm_list);
+	bp->warm_running = 1;
+	AZ(pthread_cond_signal(&vbe_warm_cond));
+	Lck_Unlock(&vbe_warm_mtx);
+}
+
+void
+VBE_WarmStop(struct backend *bp)
+{
+
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	ASSERT_CLI();
+	if (!bp->warm_running)
+		return;
+	/* Waits for the warm thread, if it is busy with this backend */
+	Lck_Lock(&vbe_warm_mtx);
+	VTAILQ_REMOVE(&vbe_warm_list, bp, warm_list);
+	bp->warm_running = 0;
+	Lck_Unlock(&vbe_warm_mtx);
 }
@@ -62,7 +62,8 @@
  *    Backends have their host/port name looked up to addrinfo structures
  *    when they are instantiated, and we just cache that result and cycle
  *    through the entries (for multihomed backends) on failure only.
- *    XXX: add cli command to redo lookup.
+ *    The lookup can be redone, periodically or with the backend.resolve
+ *    CLI command, see cache_backend_resolve.c.
  *
  *    bereq is sort of a step-child here, we just manage the pool of them.
  *
@@ -72,6 +73,9 @@ struct vbp_target;
 struct vbe_conn;
 struct vrt_backend_probe;
 
+/* Big enough for the cache lines of any CPU we care about */
+#define CACHE_LINE_SIZE		64
+
 /*--------------------------------------------------------------------
  * A director is a piece of code which selects one of possibly multiple
  * backends to use.
@@ -92,6 +96,32 @@ struct director {
 	void			*priv;
 };
 
+/*--------------------------------------------------------------------
+ * A backend connection shared by several fetches, which write their
+ * requests and read the responses in turn.
+ */
+
+struct vbe_pipeline {
+	unsigned		magic;
+#define VBE_PIPELINE_MAGIC	0x1e4bd5a3
+	int			fd;
+	VTAILQ_ENTRY(vbe_pipeline) list;
+	unsigned		listed;
+
+	/* Protected by the backend's mtx */
+	unsigned		ntx;		/* requests handed out */
+	unsigned		nwr;		/* requests written */
+	unsigned		nrx;		/* responses read */
+	unsigned		nlive;		/* from here on they fail */
+	unsigned		nuser;
+	unsigned		proven;		/* backend speaks HTTP/1.1 */
+	pthread_cond_t		cond;
+
+	/* What the previous reader read of the next response */
+	char			*carry;
+	unsigned		lcarry;
+};
+
 /*--------------------------------------------------------------------
  * An instance of a backend from a VCL program.
  */
@@ -110,32 +140,98 @@ struct backend {
 	uint32_t		hash;
 
 	VTAILQ_ENTRY(backend)	list;
+	VTAILQ_ENTRY(backend)	idle_list;
 	int			refcount;
 	struct lock		mtx;
 
+	/* Replaced under mtx when the lookup is redone */
+	char			*hostname;
+	char			*portname;
+	VTAILQ_ENTRY(backend)	resolve_list;
+	double			t_resolved;
+	unsigned		resolve_now;	/* backend.resolve asked */
+	unsigned		readdressed;	/* probe must follow */
 	struct sockaddr		*ipv4;
 	socklen_t		ipv4len;
 	struct sockaddr		*ipv6;
 	socklen_t		ipv6len;
 
 	unsigned		max_conn;
-	unsigned		n_conn;
+
+	/*
+	 * n_conn is updated with Atomic_Inc() and Atomic_Dec() rather than
+	 * under mtx, and is read by the directors on every fetch, so give
+	 * it a cache line of its own.
+	 */
+	char			pad1[CACHE_LINE_SIZE];
+	volatile unsigned	n_conn;
+	char			pad2[CACHE_LINE_SIZE];
+
 	VTAILQ_HEAD(, vbe_conn)	connlist;
 
 	struct vbp_target	*probe;
+	VTAILQ_ENTRY(backend)	probe_list;
 	unsigned		healthy;
+	double			t_healthy;	/* when it last became so */
+	double			health;		/* 0...1, see VBP */
+
+	/* Exponential average of time to first byte of fetches */
+	double			ttfb_avg;
+	double			ttfb_rate;
+
+	/* Pre-connected idle connections, see VBE_WarmStart() */
+	unsigned		min_idle;
+	VTAILQ_ENTRY(backend)	warm_list;
+	unsigned		warm_running;
+
+	/* Shared connections, see cache_backend_pipeline.c */
+	unsigned		pipeline_depth;
+	VTAILQ_HEAD(, vbe_pipeline) pipelines;
+
+	/* Exponential average of the fraction of fetches which failed */
+	double			err_avg;
+	double			t_err;		/* when one last did */
 };
 
 /* cache_backend.c */
-void VBE_ReleaseConn(struct vbe_conn *vc);
+void VBE_ReleaseConn(struct worker *w, struct vbe_conn *vc);
 struct vbe_conn *VBE_GetVbe(struct sess *sp, struct backend *bp);
+void VBE_WarmStart(struct backend *bp);
+void VBE_WarmStop(struct backend *bp);
 
 /* cache_backend_cfg.c */
 extern struct lock VBE_mtx;
 void VBE_DropRefConn(struct backend *);
 void VBE_DropRef(struct backend *);
 void VBE_DropRefLocked(struct backend *b);
+unsigned VBE_WatchRelease(void);
+int VBE_WaitRelease(unsigned *gen, double when);
+void VBE_UnwatchRelease(void);
+void VBE_Released(void);
+
+/* cache_backend_idle.c */
+void VBI_Arm(struct vbe_conn *vc);
+void VBI_Bury(struct vbe_conn *vc);
+void VBI_Forget(const struct vbe_conn *vc);
+void VBI_AddBackend(struct backend *b);
+void VBI_DelBackend(struct backend *b);
+
+/* cache_backend_pipeline.c */
+void VBL_Start(struct vbe_conn *vc);
+struct vbe_pipeline *VBL_Join(struct backend *bp, unsigned *seq);
+int VBL_WaitWrite(const struct vbe_conn *vc, double when);
+void VBL_Written(const struct vbe_conn *vc, int ok);
+int VBL_WaitRead(struct vbe_conn *vc, double when);
+int VBL_Prefill(const struct vbe_conn *vc, struct http_conn *htc);
+void VBL_Response(struct vbe_conn *vc, const struct http *hp);
+int VBL_Release(struct vbe_conn *vc, const struct http_conn *htc, int closed);
 
 /* cache_backend_poll.c */
 void VBP_Start(struct backend *b, struct vrt_backend_probe const *p);
 void VBP_Stop(struct backend *b);
+void VBP_Readdress(struct backend *b);
+
+/* cache_backend_resolve.c */
+void VBR_AddBackend(struct backend *b);
+void VBR_DelBackend(struct backend *b);
+void VBR_Request(struct backend *b, const char *host);
@@ -48,10 +48,17 @@ SVNID("$Id$")
 #include "vrt.h"
 #include "vsha256.h"
 #include "cache_backend.h"
+#include "cli.h"
 #include "cli_priv.h"
 
 struct lock VBE_mtx;
 
+/* See VBE_WatchRelease() */
+static struct lock vbe_release_mtx;
+static pthread_cond_t vbe_release_cond = PTHREAD_COND_INITIALIZER;
+static unsigned vbe_release_gen;
+static volatile unsigned vbe_release_nwait;
+
 /*
  * The list of backends is not locked, it is only ever accessed from
  * the CLI thread, so there is no need.
@@ -68,14 +75,36 @@ VBE_Nuke(struct backend *b)
 
 	ASSERT_CLI();
 	VTAILQ_REMOVE(&backends, b, list);
+	VBI_DelBackend(b);
+	if (b->hostname != NULL)
+		VBR_DelBackend(b);
 	free(b->ident);
 	free(b->hosthdr);
+	free(b->hostname);
+	free(b->portname);
 	free(b->ipv4);
 	free(b->ipv6);
 	FREE_OBJ(b);
 	VSL_stats->n_backend--;
 }
 
+/*--------------------------------------------------------------------
+ * Move the probe of a backend which got new addresses.
+ */
+
+static void
+vbe_readdress(struct backend *b)
+{
+	unsigned u;
+
+	Lck_Lock(&b->mtx);
+	u = b->readdressed;
+	b->readdressed = 0;
+	Lck_Unlock(&b->mtx);
+	if (u)
+		VBP_Readdress(b);
+}
+
 /*--------------------------------------------------------------------
  */
 
@@ -86,6 +115,7 @@ VBE_Poll(void)
 
 	ASSERT_CLI();
 	VTAILQ_FOREACH_SAFE(b, &backends, list, b2) {
+		vbe_readdress(b);
 		if (b->refcount == 0 && b->probe == NULL)
 			VBE_Nuke(b);
 	}
@@ -102,6 +132,7 @@ VBE_DropRefLocked(struct backend *b)
 {
 	int i;
 	struct vbe_conn *vbe, *vbe2;
+	VTAILQ_HEAD(, vbe_conn) dead;
 
 	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
 	assert(b->refcount > 0);
@@ -112,14 +143,24 @@ VBE_DropRefLocked(struct backend *b)
 		return;
 
 	ASSERT_CLI();
+	VBE_WarmStop(b);
+	/* The idle reaper may be looking at the connlist */
+	Lck_Lock(&b->mtx);
+	VTAILQ_INIT(&dead);
 	VTAILQ_FOREACH_SAFE(vbe, &b->connlist, list, vbe2) {
 		VTAILQ_REMOVE(&b->connlist, vbe, list);
+		vbe->idle = 0;
+		VTAILQ_INSERT_TAIL(&dead, vbe, list);
+	}
+	Lck_Unlock(&b->mtx);
+	VTAILQ_FOREACH_SAFE(vbe, &dead, list, vbe2) {
+		VTAILQ_REMOVE(&dead, vbe, list);
 		if (vbe->fd >= 0) {
 			AZ(close(vbe->fd));
 			vbe->fd = -1;
 		}
 		vbe->backend = NULL;
-		VBE_ReleaseConn(vbe);
+		VBE_ReleaseConn(NULL, vbe);
 	}
 	if (b->probe != NULL)
 		VBP_Stop(b);
@@ -140,15 +181,78 @@ VBE_DropRef(struct backend *b)
 void
 VBE_DropRefConn(struct backend *b)
 {
+	unsigned u;
 
 	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
 
+	u = Atomic_Dec(&b->n_conn);
+	assert(u != UINT_MAX);
+	VBE_Released();
 	Lck_Lock(&b->mtx);
-	assert(b->n_conn > 0);
-	b->n_conn--;
 	VBE_DropRefLocked(b);
 }
 
+/*--------------------------------------------------------------------
+ * Directors which queue sessions while their backends are full, wait
+ * here for a connection to be closed or go idle.  A session may wait
+ * for any of several backends, so they all share one condvar, and it
+ * is only signalled while somebody watches it.
+ *
+ * Watchers count themselves in before they look at the backends, and
+ * VBE_Released() is called after n_conn dropped, so either they see
+ * the connection go, or the generation moves on.
+ */
+
+unsigned
+VBE_WatchRelease(void)
+{
+	unsigned gen;
+
+	(void)Atomic_Inc(&vbe_release_nwait);
+	Lck_Lock(&vbe_release_mtx);
+	gen = vbe_release_gen;
+	Lck_Unlock(&vbe_release_mtx);
+	return (gen);
+}
+
+/* Returns non-zero if 'when' came first */
+
+int
+VBE_WaitRelease(unsigned *gen, double when)
+{
+	int i = 0;
+
+	Lck_Lock(&vbe_release_mtx);
+	while (*gen == vbe_release_gen && i == 0)
+		i = Lck_CondTimedWait(&vbe_release_cond, &vbe_release_mtx,
+		    when);
+	i = (*gen == vbe_release_gen);
+	*gen = vbe_release_gen;
+	Lck_Unlock(&vbe_release_mtx);
+	return (i);
+}
+
+void
+VBE_UnwatchRelease(void)
+{
+	unsigned u;
+
+	u = Atomic_Dec(&vbe_release_nwait);
+	assert(u != UINT_MAX);
+}
+
+void
+VBE_Released(void)
+{
+
+	if (vbe_release_nwait == 0)
+		return;
+	Lck_Lock(&vbe_release_mtx);
+	vbe_release_gen++;
+	AZ(pthread_cond_broadcast(&vbe_release_cond));
+	Lck_Unlock(&vbe_release_mtx);
+}
+
 /*--------------------------------------------------------------------*/
 
 static void
@@ -162,6 +266,40 @@ copy_sockaddr(struct sockaddr **sa, socklen_t *len, const unsigned char *src)
 	*len = *src;
 }
 
+/*--------------------------------------------------------------------
+ * The addresses of a backend can be replaced by cache_backend_resolve.c
+ * so we must hold its lock to look at them.
+ */
+
+static int
+vbe_same_addr(struct backend *b, const struct vrt_backend *vb)
+{
+	int retval = 0;
+
+	Lck_Lock(&b->mtx);
+	do {
+		if ((vb->ipv4_sockaddr == NULL) != (b->ipv4 == NULL))
+			break;
+		if ((vb->ipv6_sockaddr == NULL) != (b->ipv6 == NULL))
+			break;
+		if (vb->ipv4_sockaddr != NULL &&
+		    b->ipv4len != vb->ipv4_sockaddr[0])
+			break;
+		if (vb->ipv6_sockaddr != NULL &&
+		    b->ipv6len != vb->ipv6_sockaddr[0])
+			break;
+		if (b->ipv4len != 0 &&
+		    memcmp(b->ipv4, vb->ipv4_sockaddr + 1, b->ipv4len))
+			break;
+		if (b->ipv6len != 0 &&
+		    memcmp(b->ipv6, vb->ipv6_sockaddr + 1, b->ipv6len))
+			break;
+		retval = 1;
+	} while (0);
+	Lck_Unlock(&b->mtx);
+	return (retval);
+}
+
 /*--------------------------------------------------------------------
  * Add a backend/director instance when loading a VCL.
  * If an existing backend is matched, grab a refcount and return.
@@ -201,19 +339,10 @@ VBE_AddBackend(struct cli *cli, const struct vrt_backend *vb)
 			continue;
 		if (strcmp(b->ident, vb->ident))
 			continue;
-		if (vb->ipv4_sockaddr != NULL &&
-		    b->ipv4len != vb->ipv4_sockaddr[0])
-			continue;
-		if (vb->ipv6_sockaddr != NULL &&
-		    b->ipv6len != vb->ipv6_sockaddr[0])
-			continue;
-		if (b->ipv4len != 0 &&
-		    memcmp(b->ipv4, vb->ipv4_sockaddr + 1, b->ipv4len))
-			continue;
-		if (b->ipv6len != 0 &&
-		    memcmp(b->ipv6, vb->ipv6_sockaddr + 1, b->ipv6len))
+		if (!vbe_same_addr(b, vb))
 			continue;
 		b->refcount++;
+		VBE_WarmStart(b);
 		return (b);
 	}
 
@@ -224,6 +353,7 @@ VBE_AddBackend(struct cli *cli, const struct vrt_backend *vb)
 	b->refcount = 1;
 
 	VTAILQ_INIT(&b->connlist);
+	VTAILQ_INIT(&b->pipelines);
 	b->hash = u;
 
 	/*
@@ -233,11 +363,15 @@ VBE_AddBackend(struct cli *cli, const struct vrt_backend *vb)
 	REPLACE(b->ident, vb->ident);
 	REPLACE(b->vcl_name, vb->vcl_name);
 	REPLACE(b->hosthdr, vb->hosthdr);
+	REPLACE(b->hostname, vb->hostname);
+	REPLACE(b->portname, vb->portname);
 
 	b->connect_timeout = vb->connect_timeout;
 	b->first_byte_timeout = vb->first_byte_timeout;
 	b->between_bytes_timeout = vb->between_bytes_timeout;
 	b->max_conn = vb->max_connections;
+	b->min_idle = vb->min_idle_connections;
+	b->pipeline_depth = vb->pipeline_depth;
 
 	/*
 	 * Copy over the sockaddrs
@@ -250,7 +384,11 @@ VBE_AddBackend(struct cli *cli, const struct vrt_backend *vb)
 	assert(b->ipv4 != NULL || b->ipv6 != NULL);
 
 	VBP_Start(b, &vb->probe);
+	VBE_WarmStart(b);
 	VTAILQ_INSERT_TAIL(&backends, b, list);
+	VBI_AddBackend(b);
+	if (b->hostname != NULL)
+		VBR_AddBackend(b);
 	VSL_stats->n_backend++;
 	return (b);
 }
@@ -280,12 +418,43 @@ cli_debug_backend(struct cli *cli, const char * const *av, void *priv)
 	ASSERT_CLI();
 	VTAILQ_FOREACH(b, &backends, list) {
 		CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
-		cli_out(cli, "%p %s %d %d/%d\n",
+		cli_out(cli, "%p %s %d %d/%d %.6f %.3f %.3f\n",
 		    b, b->vcl_name, b->refcount,
-		    b->n_conn, b->max_conn);
+		    b->n_conn, b->max_conn, b->ttfb_avg, b->err_avg,
+		    b->health);
+	}
+}
+
+static void
+cli_backend_resolve(struct cli *cli, const char * const *av, void *priv)
+{
+	struct backend *b;
+	unsigned n = 0;
+
+	(void)priv;
+	ASSERT_CLI();
+	VTAILQ_FOREACH(b, &backends, list) {
+		CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+		if (b->hostname == NULL)
+			continue;
+		if (av[2] != NULL && strcmp(av[2], b->vcl_name))
+			continue;
+		n++;
+		VBR_Request(b, av[2] != NULL ? av[3] : NULL);
+		cli_out(cli, "%s %s:%s queued\n", b->vcl_name,
+		    b->hostname, b->portname);
+	}
+	if (av[2] != NULL && n == 0) {
+		cli_out(cli, "No backend named %s\n", av[2]);
+		cli_result(cli, CLIS_PARAM);
 	}
 }
 
+static struct cli_proto backend_cmds[] = {
+	{ CLI_BACKEND_RESOLVE,	cli_backend_resolve },
+	{ NULL }
+};
+
 static struct cli_proto debug_cmds[] = {
 	{ "debug.backend", "debug.backend",
 	    "\tExamine Backend internals\n", 0, 0, cli_debug_backend },
@@ -299,5 +468,7 @@ VBE_Init(void)
 {
 
 	Lck_New(&VBE_mtx);
+	Lck_New(&vbe_release_mtx);
+	CLI_AddFuncs(PUBLIC_CLI, backend_cmds);
 	CLI_AddFuncs(DEBUG_CLI, debug_cmds);
 }
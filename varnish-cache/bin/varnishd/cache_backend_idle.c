@@ -0,0 +1,324 @@
+/*-
+ * Copyright (c) 2009 Alex Kritikos
+ * All rights reserved.
+ *
+ * Author: Alex Kritikos <alex.kritikos@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Reap idle backend connections.
+ *
+ * Idle connections sit on their backends connlist until a worker
+ * thread picks them up again.  Rather than polling each of them before
+ * it is reused, we keep them registered with an epoll instance, and a
+ * single thread closes them as soon as the backend closes its end, or
+ * they have been idle for longer than params->backend_idle_timeout.
+ *
+ * The connections are registered EPOLLONESHOT when they become idle,
+ * and stay registered, so becoming idle again is a single EPOLL_CTL_MOD.
+ * A worker which picks one up leaves it armed, the backend's response
+ * wakes us up at most once, and vc->idle, which we look at under the
+ * backend's lock, tells us to ignore it.  A connection is armed before
+ * it goes on the connlist, and an event which arrives in between sets
+ * vc->hup, so whoever puts it there closes it instead.
+ *
+ * Because an event may still be on its way for a connection which
+ * a worker closed, vbe_conns which have ever been registered are not
+ * released by VBE_ReleaseConn(), but handed to us, and we release them
+ * between calls to epoll_wait(), when no stale event can refer to them.
+ *
+ * Without epoll, we only do the idle timeout, and the worker threads
+ * keep checking the connections with poll(2) before reusing them.
+ */
+
+#include "config.h"
+
+#include "svnid.h"
+SVNID("$Id$")
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(HAVE_EPOLL_CTL)
+#include <sys/epoll.h>
+
+#ifndef EPOLLRDHUP
+#  define EPOLLRDHUP 0
+#endif
+#endif
+
+#include "shmlog.h"
+#include "cache.h"
+#include "cache_backend.h"
+
+#define NEEV			100
+
+/* How often we look for connections which have been idle too long */
+#define IDLE_INTERVAL		1.0
+
+static pthread_t vbi_thread;
+static struct lock vbi_mtx;
+
+/* Protected by vbi_mtx */
+static VTAILQ_HEAD(, backend) vbi_backends =
+    VTAILQ_HEAD_INITIALIZER(vbi_backends);
+static struct vbe_connhead vbi_graveyard =
+    VTAILQ_HEAD_INITIALIZER(vbi_graveyard);
+
+#if defined(HAVE_EPOLL_CTL)
+static int vbi_epfd = -1;
+#endif
+
+/*--------------------------------------------------------------------
+ * Register a connection which is about to go on its backend's connlist.
+ * Until it is there, the caller owns it, so nobody can close it under
+ * us.  The caller must check vc->hup when it has the backend locked.
+ */
+
+void
+VBI_Arm(struct vbe_conn *vc)
+{
+#if defined(HAVE_EPOLL_CTL)
+	struct epoll_event ev;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	assert(vc->fd >= 0);
+	AZ(vc->idle);
+	vc->hup = 0;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = vc;
+	if (epoll_ctl(vbi_epfd, EPOLL_CTL_MOD, vc->fd, &ev)) {
+		assert(errno == ENOENT);
+		AZ(epoll_ctl(vbi_epfd, EPOLL_CTL_ADD, vc->fd, &ev));
+	}
+	vc->waited = 1;
+#else
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	vc->hup = 0;
+#endif
+}
+
+/*--------------------------------------------------------------------
+ * Make sure no more events refer to a registered connection, whose
+ * file descriptor is about to be shared by a pipeline.  It stays
+ * marked as registered, an event may already be on its way.
+ */
+
+void
+VBI_Forget(const struct vbe_conn *vc)
+{
+#if defined(HAVE_EPOLL_CTL)
+	struct epoll_event ev;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	assert(vc->fd >= 0);
+	AN(vc->waited);
+	memset(&ev, 0, sizeof ev);
+	AZ(epoll_ctl(vbi_epfd, EPOLL_CTL_DEL, vc->fd, &ev));
+#else
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+#endif
+}
+
+/*--------------------------------------------------------------------
+ * Take a closed, registered, connection off VBE_ReleaseConn()'s hands.
+ */
+
+void
+VBI_Bury(struct vbe_conn *vc)
+{
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	AN(vc->waited);
+	Lck_Lock(&vbi_mtx);
+	VTAILQ_INSERT_TAIL(&vbi_graveyard, vc, list);
+	Lck_Unlock(&vbi_mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Backends come and go in the CLI thread, but we need the list of them
+ * to find the connections which have been idle too long.
+ */
+
+void
+VBI_AddBackend(struct backend *b)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	Lck_Lock(&vbi_mtx);
+	VTAILQ_INSERT_TAIL(&vbi_backends, b, idle_list);
+	Lck_Unlock(&vbi_mtx);
+}
+
+void
+VBI_DelBackend(struct backend *b)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	AZ(VTAILQ_FIRST(&b->connlist));
+	Lck_Lock(&vbi_mtx);
+	VTAILQ_REMOVE(&vbi_backends, b, idle_list);
+	Lck_Unlock(&vbi_mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Take an idle connection off its backend, if it is still idle.  If it
+ * is busy, it may be on its way to the connlist, see VBI_Arm().
+ * The caller holds vbi_mtx, so the backend cannot go away under us.
+ */
+
+static int
+vbi_unidle(struct vbe_conn *vc)
+{
+	struct backend *bp;
+	int retval = 0;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	bp = vc->backend;
+	if (bp == NULL)
+		return (0);
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	Lck_Lock(&bp->mtx);
+	if (vc->idle && vc->backend == bp) {
+		VTAILQ_REMOVE(&bp->connlist, vc, list);
+		vc->idle = 0;
+		retval = 1;
+	} else if (vc->backend == bp)
+		vc->hup = 1;
+	Lck_Unlock(&bp->mtx);
+	return (retval);
+}
+
+/*--------------------------------------------------------------------
+ * Collect the connections which have been idle for too long, but leave
+ * the backend its .min_idle_connections.  The connlist is kept in most
+ * recently used order, so those are the ones at the head.
+ */
+
+static void
+vbi_timeout(struct vbe_connhead *dead, double now)
+{
+	struct backend *bp;
+	struct vbe_conn *vc, *vc2;
+	unsigned n;
+
+	if (params->backend_idle_timeout <= 0.)
+		return;
+	VTAILQ_FOREACH(bp, &vbi_backends, idle_list) {
+		CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+		n = 0;
+		Lck_Lock(&bp->mtx);
+		VTAILQ_FOREACH_SAFE(vc, &bp->connlist, list, vc2) {
+			if (n++ < bp->min_idle)
+				continue;
+			if (now - vc->t_idle < params->backend_idle_timeout)
+				continue;
+			VTAILQ_REMOVE(&bp->connlist, vc, list);
+			vc->idle = 0;
+			VTAILQ_INSERT_TAIL(dead, vc, list);
+		}
+		Lck_Unlock(&bp->mtx);
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *
+vbi_reaper(void *priv)
+{
+	struct vbe_connhead dead, buried;
+	struct vbe_conn *vc, *vc2;
+	struct backend *bp;
+	double now, t_timeout;
+#if defined(HAVE_EPOLL_CTL)
+	struct epoll_event ev[NEEV];
+	int i, n;
+#endif
+
+	THR_SetName("backend idle");
+	(void)priv;
+	t_timeout = TIM_real();
+	while (1) {
+		VTAILQ_INIT(&dead);
+		VTAILQ_INIT(&buried);
+#if defined(HAVE_EPOLL_CTL)
+		n = epoll_wait(vbi_epfd, ev, NEEV, (int)(IDLE_INTERVAL * 1e3));
+		Lck_Lock(&vbi_mtx);
+		for (i = 0; i < n; i++) {
+			CAST_OBJ_NOTNULL(vc, ev[i].data.ptr, VBE_CONN_MAGIC);
+			if (vbi_unidle(vc))
+				VTAILQ_INSERT_TAIL(&dead, vc, list);
+		}
+#else
+		TIM_sleep(IDLE_INTERVAL);
+		Lck_Lock(&vbi_mtx);
+#endif
+		now = TIM_real();
+		if (now - t_timeout >= IDLE_INTERVAL) {
+			vbi_timeout(&dead, now);
+			t_timeout = now;
+		}
+		VTAILQ_CONCAT(&buried, &vbi_graveyard, list);
+
+		/*
+		 * Close the dead ones before we let go of vbi_mtx, once
+		 * they are off the connlist only we can get at them.
+		 */
+		VTAILQ_FOREACH(vc, &dead, list) {
+			bp = vc->backend;
+			CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+			VSL(SLT_BackendClose, vc->fd, "%s", bp->vcl_name);
+			TCP_close(&vc->fd);
+			(void)Atomic_Dec(&bp->n_conn);
+			vc->backend = NULL;
+			VSL_stats->backend_idle_close++;
+		}
+		Lck_Unlock(&vbi_mtx);
+
+		/* Nothing left in epoll can refer to these now */
+		VTAILQ_CONCAT(&buried, &dead, list);
+		VTAILQ_FOREACH_SAFE(vc, &buried, list, vc2) {
+			VTAILQ_REMOVE(&buried, vc, list);
+			vc->waited = 0;
+			VBE_ReleaseConn(NULL, vc);
+		}
+	}
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+void
+VBI_Init(void)
+{
+
+	Lck_New(&vbi_mtx);
+#if defined(HAVE_EPOLL_CTL)
+	vbi_epfd = epoll_create(1);
+	assert(vbi_epfd >= 0);
+#endif
+	AZ(pthread_create(&vbi_thread, NULL, vbi_reaper, NULL));
+}
@@ -0,0 +1,336 @@
+/*-
+ * Copyright (c) 2009 Alex Kritikos
+ * All rights reserved.
+ *
+ * Author: Alex Kritikos <alex.kritikos@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Pipeline requests to backends.
+ *
+ * A backend with a .pipeline_depth above one lets GET requests without
+ * a body share a connection: each fetch which joins the pipeline gets
+ * a sequence number, writes its request when the fetch before it has
+ * written its own, and reads its response when the fetch before it is
+ * done reading.  Whatever the previous reader read beyond the end of its
+ * response is handed on through the pipeline.
+ *
+ * Each fetch still has a vbe_conn of its own, for the directors and the
+ * accounting, they just share the file descriptor, which is owned by
+ * the pipeline until the last of them lets go of it.
+ *
+ * If the connection breaks, or the backend closes it after a response,
+ * the fetches behind it fail with -1 from VBL_WaitWrite() or
+ * VBL_WaitRead(), and FetchHdr() sends them again on a connection of
+ * their own.  So do the fetches behind one which gave up waiting for
+ * its turn, as the backend's timeouts allow no more.  Nobody joins a pipeline before a response on it has shown
+ * that the backend speaks HTTP/1.1, as the response of a HTTP/1.0
+ * backend could run until EOF and swallow the ones behind it.
+ *
+ * All of the state is protected by the backend's mtx.
+ */
+
+#include "config.h"
+
+#include "svnid.h"
+SVNID("$Id$")
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shmlog.h"
+#include "cache.h"
+#include "cache_backend.h"
+
+/*--------------------------------------------------------------------
+ * Stop anyone from joining, and fail the fetches from seq and on.
+ */
+
+static void
+vbl_break(struct backend *bp, struct vbe_pipeline *pl, unsigned seq)
+{
+
+	if (seq < pl->nlive)
+		pl->nlive = seq;
+	if (pl->listed) {
+		VTAILQ_REMOVE(&bp->pipelines, pl, list);
+		pl->listed = 0;
+	}
+	AZ(pthread_cond_broadcast(&pl->cond));
+}
+
+/*--------------------------------------------------------------------
+ * Turn a connection of our own into a pipeline others can join.
+ */
+
+void
+VBL_Start(struct vbe_conn *vc)
+{
+	struct vbe_pipeline *pl;
+	struct backend *bp;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	AZ(vc->pipeline);
+	assert(vc->fd >= 0);
+	bp = vc->backend;
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+
+	ALLOC_OBJ(pl, VBE_PIPELINE_MAGIC);
+	XXXAN(pl);
+	AZ(pthread_cond_init(&pl->cond, NULL));
+	pl->fd = vc->fd;
+	pl->ntx = 1;
+	pl->nlive = UINT_MAX;
+	pl->nuser = 1;
+	pl->proven = vc->proven;
+
+	/*
+	 * The fd may outlive this vbe_conn now, so the idle reaper must
+	 * not have it registered under our name.
+	 */
+	if (vc->waited)
+		VBI_Forget(vc);
+
+	vc->pipeline = pl;
+	vc->seq = 0;
+
+	Lck_Lock(&bp->mtx);
+	VTAILQ_INSERT_TAIL(&bp->pipelines, pl, list);
+	pl->listed = 1;
+	Lck_Unlock(&bp->mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Find a pipeline with room for one more request.
+ * Grabs a reference to the backend, like taking an idle connection.
+ */
+
+struct vbe_pipeline *
+VBL_Join(struct backend *bp, unsigned *seq)
+{
+	struct vbe_pipeline *pl;
+
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	Lck_Lock(&bp->mtx);
+	VTAILQ_FOREACH(pl, &bp->pipelines, list) {
+		CHECK_OBJ_NOTNULL(pl, VBE_PIPELINE_MAGIC);
+		if (pl->proven && pl->ntx - pl->nrx < bp->pipeline_depth)
+			break;
+	}
+	if (pl != NULL) {
+		*seq = pl->ntx++;
+		pl->nuser++;
+		bp->refcount++;
+		VSL_stats->backend_pipeline++;
+	}
+	Lck_Unlock(&bp->mtx);
+	return (pl);
+}
+
+/*--------------------------------------------------------------------
+ * Wait for our turn to write our request, until 'when' at the latest.
+ */
+
+int
+VBL_WaitWrite(const struct vbe_conn *vc, double when)
+{
+	struct vbe_pipeline *pl;
+	struct backend *bp;
+	int retval;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	CAST_OBJ_NOTNULL(pl, vc->pipeline, VBE_PIPELINE_MAGIC);
+	bp = vc->backend;
+	Lck_Lock(&bp->mtx);
+	while (pl->nwr != vc->seq && vc->seq < pl->nlive)
+		if (Lck_CondTimedWait(&pl->cond, &bp->mtx, when) &&
+		    pl->nwr != vc->seq)
+			vbl_break(bp, pl, vc->seq);
+	retval = (vc->seq < pl->nlive) ? 0 : -1;
+	Lck_Unlock(&bp->mtx);
+	return (retval);
+}
+
+void
+VBL_Written(const struct vbe_conn *vc, int ok)
+{
+	struct vbe_pipeline *pl;
+	struct backend *bp;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	CAST_OBJ_NOTNULL(pl, vc->pipeline, VBE_PIPELINE_MAGIC);
+	bp = vc->backend;
+	Lck_Lock(&bp->mtx);
+	assert(pl->nwr == vc->seq);
+	if (ok) {
+		pl->nwr++;
+		AZ(pthread_cond_broadcast(&pl->cond));
+	} else
+		vbl_break(bp, pl, vc->seq);
+	Lck_Unlock(&bp->mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Wait for our turn to read our response, until 'when' at the latest.
+ */
+
+int
+VBL_WaitRead(struct vbe_conn *vc, double when)
+{
+	struct vbe_pipeline *pl;
+	struct backend *bp;
+	int retval;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	CAST_OBJ_NOTNULL(pl, vc->pipeline, VBE_PIPELINE_MAGIC);
+	bp = vc->backend;
+	Lck_Lock(&bp->mtx);
+	while (pl->nrx != vc->seq && vc->seq < pl->nlive)
+		if (Lck_CondTimedWait(&pl->cond, &bp->mtx, when) &&
+		    pl->nrx != vc->seq)
+			vbl_break(bp, pl, vc->seq);
+	retval = -1;
+	if (vc->seq < pl->nlive) {
+		vc->reading = 1;
+		retval = 0;
+	}
+	Lck_Unlock(&bp->mtx);
+	return (retval);
+}
+
+/*--------------------------------------------------------------------
+ * Put what the previous reader left us into our receive buffer.
+ * Returns like HTC_Rx(), if there was anything.
+ */
+
+int
+VBL_Prefill(const struct vbe_conn *vc, struct http_conn *htc)
+{
+	struct vbe_pipeline *pl;
+	unsigned l;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	CAST_OBJ_NOTNULL(pl, vc->pipeline, VBE_PIPELINE_MAGIC);
+	CHECK_OBJ_NOTNULL(htc, HTTP_CONN_MAGIC);
+	AN(vc->reading);
+
+	/* Only we can touch the carry while it is our turn */
+	l = pl->lcarry;
+	if (l == 0)
+		return (0);
+	pl->lcarry = 0;
+	if (htc->rxbuf.e + l >= htc->ws->r) {
+		WS_ReleaseP(htc->ws, htc->rxbuf.b);
+		return (-2);
+	}
+	memcpy(htc->rxbuf.e, pl->carry, l);
+	htc->rxbuf.e += l;
+	*htc->rxbuf.e = '\0';
+	return (HTC_Complete(htc));
+}
+
+/*--------------------------------------------------------------------
+ * Note what the backend told us about itself in a response.
+ */
+
+void
+VBL_Response(struct vbe_conn *vc, const struct http *hp)
+{
+	struct vbe_pipeline *pl;
+	struct backend *bp;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	CAST_OBJ_NOTNULL(pl, vc->pipeline, VBE_PIPELINE_MAGIC);
+	bp = vc->backend;
+	Lck_Lock(&bp->mtx);
+	if (hp->protover >= 1.1 && !http_HdrIs(hp, H_Connection, "close"))
+		pl->proven = 1;
+	else
+		vbl_break(bp, pl, vc->seq + 1);
+	Lck_Unlock(&bp->mtx);
+}
+
+/*--------------------------------------------------------------------
+ * A fetch is done with the pipeline.
+ *
+ * Returns zero if others still use the connection, and the caller just
+ * gets rid of its vbe_conn.  Otherwise the connection is handed back to
+ * the caller's vbe_conn, and it should close it (-1) or recycle it (1).
+ */
+
+int
+VBL_Release(struct vbe_conn *vc, const struct http_conn *htc, int closed)
+{
+	struct vbe_pipeline *pl;
+	struct backend *bp;
+	unsigned l;
+	int retval;
+
+	CHECK_OBJ_NOTNULL(vc, VBE_CONN_MAGIC);
+	CAST_OBJ_NOTNULL(pl, vc->pipeline, VBE_PIPELINE_MAGIC);
+	bp = vc->backend;
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	vc->pipeline = NULL;
+
+	Lck_Lock(&bp->mtx);
+	if (vc->reading) {
+		assert(pl->nrx == vc->seq);
+		AZ(pl->lcarry);
+		if (!closed && htc->pipeline.b != NULL) {
+			/* Hand on what we read of the next response */
+			l = Tlen(htc->pipeline);
+			free(pl->carry);
+			pl->carry = malloc(l);
+			XXXAN(pl->carry);
+			memcpy(pl->carry, htc->pipeline.b, l);
+			pl->lcarry = l;
+		}
+		pl->nrx++;
+		vc->reading = 0;
+	}
+	if (closed)
+		vbl_break(bp, pl, vc->seq + 1);
+	AZ(pthread_cond_broadcast(&pl->cond));
+	if (--pl->nuser > 0) {
+		Lck_Unlock(&bp->mtx);
+		return (0);
+	}
+	if (pl->listed) {
+		VTAILQ_REMOVE(&bp->pipelines, pl, list);
+		pl->listed = 0;
+	}
+	Lck_Unlock(&bp->mtx);
+
+	/* We were the last, the connection is ours again */
+	assert(pl->nrx == pl->ntx || pl->nlive != UINT_MAX);
+	retval = 1;
+	if (pl->nlive != UINT_MAX || pl->lcarry > 0)
+		retval = -1;
+	vc->fd = pl->fd;
+	vc->proven = pl->proven;
+	AZ(pthread_cond_destroy(&pl->cond));
+	free(pl->carry);
+	FREE_OBJ(pl);
+	return (retval);
+}
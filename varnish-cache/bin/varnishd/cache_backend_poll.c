@@ -28,10 +28,19 @@
  *
  * Poll backends for collection of health statistics
  *
- * We co-opt threads from the worker pool for probing the backends,
- * but we want to avoid a potentially messy cleanup operation when we
- * retire the backend, so the thread owns the health information, which
- * the backend references, rather than the other way around.
+ * A single thread runs an event loop which multiplexes the probes of
+ * all the backends, each of which has a timer which starts a probe
+ * every .interval, and while a probe is in progress, an event on its
+ * socket.  We want to avoid a potentially messy cleanup operation when
+ * we retire the backend, so the target owns the health information,
+ * which the backend references, rather than the other way around.
+ *
+ * Backends with the same addresses and the same probe share a target,
+ * no matter which VCL or director they come from, so that the backend
+ * server only sees one set of probes.
+ *
+ * The event loop is not thread-safe, so the CLI thread passes targets
+ * to start and stop through a pipe, and waits for a target to stop.
  *
  */
 
@@ -40,12 +49,11 @@
 #include "svnid.h"
 SVNID("$Id$")
 
+#include <errno.h>
 #include <stdio.h>
-#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <poll.h>
 
 #include <sys/socket.h>
 
@@ -53,18 +61,38 @@ SVNID("$Id$")
 #include "cli_priv.h"
 #include "cache.h"
 #include "vrt.h"
+#include "vev.h"
 #include "cache_backend.h"
 
 /* Default averaging rate, we want something pretty responsive */
 #define AVG_RATE			4
 
+/* A healthy backend never gets a lower health score than this */
+#define HEALTH_MIN			0.01
+
+struct vbp_addr {
+	int				pf;
+	const struct sockaddr		*sa;
+	socklen_t			salen;
+	uint64_t			*good;
+};
+
 struct vbp_target {
 	unsigned			magic;
 #define VBP_TARGET_MAGIC		0x6b7cb656
 
-	struct backend			*backend;
+	/* The backends we feed, changed by the CLI thread under vbp_mtx */
+	VTAILQ_HEAD(, backend)		backends;
+
+	/* Our own copy of their addresses */
+	struct sockaddr			*ipv4;
+	socklen_t			ipv4len;
+	struct sockaddr			*ipv6;
+	socklen_t			ipv6len;
+
 	struct vrt_backend_probe	probe;
 	int				stop;
+	int				stopped;
 	char				*req;
 	int				req_len;
 
@@ -80,255 +108,441 @@ struct vbp_target {
 	double				avg;
 	double				rate;
 
+	unsigned			healthy;
+	double				t_healthy;
+	double				health;
+
 	VTAILQ_ENTRY(vbp_target)	list;
-	pthread_t			thread;
+
+	/* Owned by the event loop */
+	struct vev			*ev_timer;
+	struct vev			*ev_poke;
+	int				fd;
+	double				t_start;
+	double				t_end;
+	unsigned			rlen;
+	struct vbp_addr			addr[3];
+	unsigned			naddr;
+	unsigned			iaddr;
 };
 
 static VTAILQ_HEAD(, vbp_target)	vbp_list =
     VTAILQ_HEAD_INITIALIZER(vbp_list);
 
+static struct vev_base		*vbp_evb;
+static int			vbp_pipe[2];
+static pthread_t		vbp_thread;
+static struct lock		vbp_mtx;
+static pthread_cond_t		vbp_cond;
+
 static const char default_request[] =
     "GET / HTTP/1.1\r\n"
     "Connection: close\r\n"
     "\r\n";
 
+static void vbp_connect(struct vbp_target *vt);
+
+/*--------------------------------------------------------------------
+ * The health score is the fraction of good probes in the window, scaled
+ * down as the average response time of the good probes approaches the
+ * timeout, so that directors can send less traffic to a backend which
+ * is struggling, long before it is marked sick.
+ */
+
+static double
+vbp_health_score(const struct vbp_target *vt)
+{
+	double h, r;
+
+	h = (double)vt->good / vt->probe.window;
+	r = 1.0 - vt->avg / vt->probe.timeout;
+	if (r < 0.0)
+		r = 0.0;
+	h *= r;
+	if (vt->good >= vt->probe.threshold && h < HEALTH_MIN)
+		h = HEALTH_MIN;
+	if (h > 1.0)
+		h = 1.0;
+	return (h);
+}
+
+/*--------------------------------------------------------------------
+ * Account for a finished probe, whichever way it went.
+ */
+
+static void
+vbp_update(struct vbp_target *vt)
+{
+	unsigned i, j;
+	uint64_t u;
+	const char *logmsg;
+	char bits[10];
+	struct backend *bp;
+
+	/* Calculate exponential average */
+	if (vt->happy & 1) {
+		if (vt->rate < AVG_RATE)
+			vt->rate += 1.0;
+		vt->avg += (vt->last - vt->avg) / vt->rate;
+	}
+
+	i = 0;
+#define BITMAP(n, c, t, b)	bits[i++] = (vt->n & 1) ? c : '-';
+#include "cache_backend_poll.h"
+#undef BITMAP
+	bits[i] = '\0';
+
+	u = vt->happy;
+	for (i = j = 0; i < vt->probe.window; i++) {
+		if (u & 1)
+			j++;
+		u >>= 1;
+	}
+	vt->good = j;
+	vt->health = vbp_health_score(vt);
+
+	if (vt->good >= vt->probe.threshold) {
+		if (vt->healthy) {
+			logmsg = "Still healthy";
+		} else {
+			logmsg = "Back healthy";
+			vt->t_healthy = TIM_real();
+		}
+		vt->healthy = 1;
+	} else {
+		if (vt->healthy)
+			logmsg = "Went sick";
+		else
+			logmsg = "Still sick";
+		vt->healthy = 0;
+	}
+
+	Lck_Lock(&vbp_mtx);
+	VTAILQ_FOREACH(bp, &vt->backends, probe_list) {
+		CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+		bp->health = vt->health;
+		bp->t_healthy = vt->t_healthy;
+		bp->healthy = vt->healthy;
+		VSL(SLT_Backend_health, 0, "%s %s %s %u %u %u %.6f %.6f %s",
+		    bp->vcl_name, logmsg, bits,
+		    vt->good, vt->probe.threshold, vt->probe.window,
+		    vt->last, vt->avg, vt->resp_buf);
+	}
+	Lck_Unlock(&vbp_mtx);
+}
+
+static void
+vbp_done(struct vbp_target *vt)
+{
+
+	if (vt->fd >= 0)
+		TCP_close(&vt->fd);
+	vt->ev_poke = NULL;
+	vbp_update(vt);
+}
+
+/*--------------------------------------------------------------------
+ * Wait for an event on the probe's socket, until the probe times out.
+ */
+
+static void
+vbp_wait(struct vbp_target *vt, unsigned flags, vev_cb_f *func)
+{
+	struct vev *e;
+
+	e = vev_new();
+	XXXAN(e);
+	e->name = "vbp_poke";
+	e->fd = vt->fd;
+	e->fd_flags = flags;
+	e->timeout = vt->t_end - TIM_real();
+	if (e->timeout < 1e-3)
+		e->timeout = 1e-3;
+	e->callback = func;
+	e->priv = vt;
+	AZ(vev_add(vbp_evb, e));
+	vt->ev_poke = e;
+}
+
 /*--------------------------------------------------------------------
  * Poke one backend, once, but possibly at both IPv4 and IPv6 addresses.
  *
  * We do deliberately not use the stuff in cache_backend.c, because we
  * want to measure the backends response without local distractions.
+ *
+ * The callbacks return non-zero when they are done with their event,
+ * which makes vev delete it, they will have set up the next one.
  */
 
 static int
-vbp_connect(int pf, const struct sockaddr *sa, socklen_t salen, int tmo)
+vbp_recv(const struct vev *e, int what)
 {
-	int s, i;
+	struct vbp_target *vt;
+	char buf[8192], *p;
+	unsigned resp;
+	int i;
+
+	CAST_OBJ_NOTNULL(vt, e->priv, VBP_TARGET_MAGIC);
+	if (what == 0) {
+		/* Timed out */
+		vbp_done(vt);
+		return (1);
+	}
+	if (vt->rlen < sizeof vt->resp_buf)
+		i = read(vt->fd, vt->resp_buf + vt->rlen,
+		    sizeof vt->resp_buf - vt->rlen);
+	else
+		i = read(vt->fd, buf, sizeof buf);
+	if (i < 0 && errno == EAGAIN)
+		return (0);
+	if (i > 0) {
+		vt->rlen += i;
+		return (0);
+	}
+	if (i < 0 || vt->rlen == 0) {
+		if (i < 0)
+			vt->err_recv |= 1;
+		vbp_done(vt);
+		return (1);
+	}
 
-	s = socket(pf, SOCK_STREAM, 0);
-	if (s < 0)
-		return (s);
+	/* So we have a good receive ... */
+	vt->last = TIM_real() - vt->t_start;
+	vt->good_recv |= 1;
 
-	i = TCP_connect(s, sa, salen, tmo);
-	if (i == 0)
-		return (s);
-	TCP_close(&s);
-	return (-1);
+	/* Now find out if we like the response */
+	vt->resp_buf[sizeof vt->resp_buf - 1] = '\0';
+	p = strchr(vt->resp_buf, '\r');
+	if (p != NULL)
+		*p = '\0';
+	p = strchr(vt->resp_buf, '\n');
+	if (p != NULL)
+		*p = '\0';
+
+	i = sscanf(vt->resp_buf, "HTTP/%*f %u %s", &resp, buf);
+
+	if (i == 2 && resp == 200)
+		vt->happy |= 1;
+	vbp_done(vt);
+	return (1);
 }
 
 static void
-vbp_poke(struct vbp_target *vt)
+vbp_send(struct vbp_target *vt)
 {
-	int s, tmo, i;
-	double t_start, t_now, t_end;
-	unsigned rlen, resp;
-	struct backend *bp;
-	char buf[8192], *p;
-	struct pollfd pfda[1], *pfd = pfda;
-
-	bp = vt->backend;
-	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
-
-	t_start = t_now = TIM_real();
-	t_end = t_start + vt->probe.timeout;
-	tmo = (int)round((t_end - t_now) * 1e3);
-
-	s = -1;
-	if (params->prefer_ipv6 && bp->ipv6 != NULL) {
-		s = vbp_connect(PF_INET6, bp->ipv6, bp->ipv6len, tmo);
-		t_now = TIM_real();
-		tmo = (int)round((t_end - t_now) * 1e3);
-		if (s >= 0)
-			vt->good_ipv6 |= 1;
-	}
-	if (tmo > 0 && s < 0 && bp->ipv4 != NULL) {
-		s = vbp_connect(PF_INET, bp->ipv4, bp->ipv4len, tmo);
-		t_now = TIM_real();
-		tmo = (int)round((t_end - t_now) * 1e3);
-		if (s >= 0)
-			vt->good_ipv4 |= 1;
-	}
-	if (tmo > 0 && s < 0 && bp->ipv6 != NULL) {
-		s = vbp_connect(PF_INET6, bp->ipv6, bp->ipv6len, tmo);
-		t_now = TIM_real();
-		tmo = (int)round((t_end - t_now) * 1e3);
-		if (s >= 0)
-			vt->good_ipv6 |= 1;
-	}
-	if (s < 0) {
-		/* Got no connection: failed */
-		return;
-	}
-	if (tmo <= 0) {
-		/* Spent too long time getting it */
-		TCP_close(&s);
-		return;
-	}
+	int i;
 
 	/* Send the request */
-	i = write(s, vt->req, vt->req_len);
+	i = write(vt->fd, vt->req, vt->req_len);
 	if (i != vt->req_len) {
 		if (i < 0)
 			vt->err_xmit |= 1;
-		TCP_close(&s);
+		vbp_done(vt);
 		return;
 	}
 	vt->good_xmit |= 1;
 
 	/* And do a shutdown(WR) so we know that the backend got it */
-	i = shutdown(s, SHUT_WR);
+	i = shutdown(vt->fd, SHUT_WR);
 	if (i != 0) {
 		vt->err_shut |= 1;
-		TCP_close(&s);
+		vbp_done(vt);
 		return;
 	}
 	vt->good_shut |= 1;
 
 	/* Check if that took too long time */
-	t_now = TIM_real();
-	tmo = (int)round((t_end - t_now) * 1e3);
-	if (tmo < 0) {
-		TCP_close(&s);
+	if (TIM_real() > vt->t_end) {
+		vbp_done(vt);
 		return;
 	}
+	vt->rlen = 0;
+	vbp_wait(vt, EV_RD, vbp_recv);
+}
 
-	pfd->fd = s;
-	rlen = 0;
-	do {
-		pfd->events = POLLIN;
-		pfd->revents = 0;
-		tmo = (int)round((t_end - t_now) * 1e3);
-		if (tmo > 0)
-			i = poll(pfd, 1, tmo);
-		if (i == 0 || tmo <= 0) {
-			TCP_close(&s);
-			return;
-		}
-		if (rlen < sizeof vt->resp_buf)
-			i = read(s, vt->resp_buf + rlen,
-			    sizeof vt->resp_buf - rlen);
-		else
-			i = read(s, buf, sizeof buf);
-		rlen += i;
-	} while (i > 0);
+static int
+vbp_connected(const struct vev *e, int what)
+{
+	struct vbp_target *vt;
+	socklen_t l;
+	int i;
+
+	CAST_OBJ_NOTNULL(vt, e->priv, VBP_TARGET_MAGIC);
+	if (what == 0) {
+		/* Spent too long time getting it */
+		vbp_done(vt);
+		return (1);
+	}
+	l = sizeof i;
+	AZ(getsockopt(vt->fd, SOL_SOCKET, SO_ERROR, &i, &l));
+	if (i != 0) {
+		TCP_close(&vt->fd);
+		vt->ev_poke = NULL;
+		vbp_connect(vt);
+		return (1);
+	}
+	*vt->addr[vt->iaddr - 1].good |= 1;
+	vbp_send(vt);
+	return (1);
+}
 
-	TCP_close(&s);
+/* Try the next address until one of them gets us started. */
 
-	if (i < 0) {
-		vt->err_recv |= 1;
-		return;
+static void
+vbp_connect(struct vbp_target *vt)
+{
+	const struct vbp_addr *va;
+
+	while (vt->iaddr < vt->naddr && TIM_real() < vt->t_end) {
+		va = &vt->addr[vt->iaddr++];
+		vt->fd = socket(va->pf, SOCK_STREAM, 0);
+		if (vt->fd < 0)
+			continue;
+		TCP_nonblocking(vt->fd);
+		if (connect(vt->fd, va->sa, va->salen) == 0) {
+			*va->good |= 1;
+			vbp_send(vt);
+			return;
+		}
+		if (errno == EINPROGRESS) {
+			vbp_wait(vt, EV_WR, vbp_connected);
+			return;
+		}
+		TCP_close(&vt->fd);
 	}
+	/* Got no connection: failed */
+	vbp_done(vt);
+}
 
-	if (rlen == 0)
-		return;
+static void
+vbp_addr(struct vbp_target *vt, int pf, const struct sockaddr *sa,
+    socklen_t salen, uint64_t *good)
+{
 
-	/* So we have a good receive ... */
-	t_now = TIM_real();
-	vt->last = t_now - t_start;
-	vt->good_recv |= 1;
+	if (sa == NULL)
+		return;
+	assert(vt->naddr < sizeof vt->addr / sizeof vt->addr[0]);
+	vt->addr[vt->naddr].pf = pf;
+	vt->addr[vt->naddr].sa = sa;
+	vt->addr[vt->naddr].salen = salen;
+	vt->addr[vt->naddr].good = good;
+	vt->naddr++;
+}
 
-	/* Now find out if we like the response */
-	vt->resp_buf[sizeof vt->resp_buf - 1] = '\0';
-	p = strchr(vt->resp_buf, '\r');
-	if (p != NULL)
-		*p = '\0';
-	p = strchr(vt->resp_buf, '\n');
-	if (p != NULL)
-		*p = '\0';
+static void
+vbp_poke(struct vbp_target *vt)
+{
 
-	i = sscanf(vt->resp_buf, "HTTP/%*f %u %s", &resp, buf);
+	/* The previous one is still going, we can only wait */
+	if (vt->ev_poke != NULL)
+		return;
 
-	if (i == 2 && resp == 200)
-		vt->happy |= 1;
+	/*lint -e{525} indent */
+#define BITMAP(n, c, t, b)	vt->n <<= 1;
+#include "cache_backend_poll.h"
+#undef BITMAP
+	vt->last = 0;
+	vt->resp_buf[0] = '\0';
+
+	vt->t_start = TIM_real();
+	vt->t_end = vt->t_start + vt->probe.timeout;
+
+	vt->naddr = vt->iaddr = 0;
+	if (params->prefer_ipv6)
+		vbp_addr(vt, PF_INET6, vt->ipv6, vt->ipv6len, &vt->good_ipv6);
+	vbp_addr(vt, PF_INET, vt->ipv4, vt->ipv4len, &vt->good_ipv4);
+	vbp_addr(vt, PF_INET6, vt->ipv6, vt->ipv6len, &vt->good_ipv6);
+	vbp_connect(vt);
 }
 
 /*--------------------------------------------------------------------
- * One thread per backend to be poked.
+ * The event loop, and how the CLI thread talks to it.
  */
 
-static void *
-vbp_wrk_poll_backend(void *priv)
+static int
+vbp_timer(const struct vev *e, int what)
 {
 	struct vbp_target *vt;
-	unsigned i, j;
-	uint64_t u;
-	const char *logmsg;
-	char bits[10];
 
-	THR_SetName("backend poll");
+	(void)what;
+	CAST_OBJ_NOTNULL(vt, e->priv, VBP_TARGET_MAGIC);
+	vbp_poke(vt);
+	return (0);
+}
 
-	CAST_OBJ_NOTNULL(vt, priv, VBP_TARGET_MAGIC);
+static void
+vbp_start_target(struct vbp_target *vt)
+{
+	struct vev *e;
+
+	e = vev_new();
+	XXXAN(e);
+	e->name = "vbp_timer";
+	e->timeout = vt->probe.interval;
+	e->callback = vbp_timer;
+	e->priv = vt;
+	AZ(vev_add(vbp_evb, e));
+	vt->ev_timer = e;
+	vbp_poke(vt);
+}
 
-	/*
-	 * Establish defaults
-	 * XXX: we could make these defaults parameters
-	 */
-	if (vt->probe.request == NULL)
-		vt->probe.request = default_request;
-	if (vt->probe.timeout == 0.0)
-		vt->probe.timeout = 2.0;
-	if (vt->probe.interval == 0.0)
-		vt->probe.interval = 5.0;
-	if (vt->probe.window == 0)
-		vt->probe.window = 8;
-	if (vt->probe.threshold == 0)
-		vt->probe.threshold = 3;
+static void
+vbp_stop_target(struct vbp_target *vt)
+{
 
-	printf("Probe(\"%s\", %g, %g)\n",
-	    vt->req,
-	    vt->probe.timeout,
-	    vt->probe.interval);
+	if (vt->ev_poke != NULL) {
+		vev_del(vbp_evb, vt->ev_poke);
+		free(vt->ev_poke);
+		vt->ev_poke = NULL;
+	}
+	if (vt->fd >= 0)
+		TCP_close(&vt->fd);
+	vev_del(vbp_evb, vt->ev_timer);
+	free(vt->ev_timer);
+	vt->ev_timer = NULL;
+
+	Lck_Lock(&vbp_mtx);
+	vt->stopped = 1;
+	AZ(pthread_cond_broadcast(&vbp_cond));
+	Lck_Unlock(&vbp_mtx);
+}
 
-	/*lint -e{525} indent */
-	while (!vt->stop) {
-#define BITMAP(n, c, t, b)	vt->n <<= 1;
-#include "cache_backend_poll.h"
-#undef BITMAP
-		vt->last = 0;
-		vt->resp_buf[0] = '\0';
-		vbp_poke(vt);
-
-		/* Calculate exponential average */
-		if (vt->happy & 1) {
-			if (vt->rate < AVG_RATE)
-				vt->rate += 1.0;
-			vt->avg += (vt->last - vt->avg) / vt->rate;
-		}
+static int
+vbp_pipe_read(const struct vev *e, int what)
+{
+	struct vbp_target *vt;
 
-		i = 0;
-#define BITMAP(n, c, t, b)	bits[i++] = (vt->n & 1) ? c : '-';
-#include "cache_backend_poll.h"
-#undef BITMAP
-		bits[i] = '\0';
+	(void)what;
+	assert(read(e->fd, &vt, sizeof vt) == sizeof vt);
+	CHECK_OBJ_NOTNULL(vt, VBP_TARGET_MAGIC);
+	if (vt->stop)
+		vbp_stop_target(vt);
+	else
+		vbp_start_target(vt);
+	return (0);
+}
 
-		u = vt->happy;
-		for (i = j = 0; i < vt->probe.window; i++) {
-			if (u & 1)
-				j++;
-			u >>= 1;
-		}
-		vt->good = j;
-
-		if (vt->good >= vt->probe.threshold) {
-			if (vt->backend->healthy)
-				logmsg = "Still healthy";
-			else
-				logmsg = "Back healthy";
-			vt->backend->healthy = 1;
-		} else {
-			if (vt->backend->healthy)
-				logmsg = "Went sick";
-			else
-				logmsg = "Still sick";
-			vt->backend->healthy = 0;
-		}
-		VSL(SLT_Backend_health, 0, "%s %s %s %u %u %u %.6f %.6f %s",
-		    vt->backend->vcl_name, logmsg, bits,
-		    vt->good, vt->probe.threshold, vt->probe.window,
-		    vt->last, vt->avg, vt->resp_buf);
+static void *
+vbp_wrk_poll(void *priv)
+{
+	struct vev *e;
 
-		if (!vt->stop)
-			TIM_sleep(vt->probe.interval);
-	}
+	THR_SetName("backend poll");
+	(void)priv;
+
+	vbp_evb = vev_new_base();
+	XXXAN(vbp_evb);
+
+	e = vev_new();
+	XXXAN(e);
+	e->name = "vbp_pipe";
+	e->fd = vbp_pipe[0];
+	e->fd_flags = EV_RD;
+	e->callback = vbp_pipe_read;
+	AZ(vev_add(vbp_evb, e));
+
+	(void)vev_schedule(vbp_evb);
+	WRONG("Backend poll event loop ended");
 	return (NULL);
 }
 
@@ -357,13 +571,15 @@ vbp_bitmap(struct cli *cli, char c, uint64_t map, const char *lbl)
 static void
 vbp_health_one(struct cli *cli, const struct vbp_target *vt)
 {
+	const struct backend *bp;
 
-	cli_out(cli, "Backend %s is %s\n",
-	    vt->backend->vcl_name,
-	    vt->backend->healthy ? "Healthy" : "Sick");
+	VTAILQ_FOREACH(bp, &vt->backends, probe_list)
+		cli_out(cli, "Backend %s is %s\n",
+		    bp->vcl_name, bp->healthy ? "Healthy" : "Sick");
 	cli_out(cli, "Current states  good: %2u threshold: %2u window: %2u\n",
 	    vt->good, vt->probe.threshold, vt->probe.window);
 	cli_out(cli, "Average responsetime of good probes: %.6f\n", vt->avg);
+	cli_out(cli, "Health score: %.3f\n", vt->health);
 	cli_out(cli,
 	    "Oldest                       "
 	    "                             Newest\n");
@@ -398,6 +614,110 @@ static struct cli_proto debug_cmds[] = {
 	{ NULL }
 };
 
+/*--------------------------------------------------------------------
+ * Find a running target which probes the same addresses the same way.
+ */
+
+static int
+vbp_same_addr(const struct sockaddr *sa1, socklen_t l1,
+    const struct sockaddr *sa2, socklen_t l2)
+{
+
+	if (sa1 == NULL || sa2 == NULL)
+		return (sa1 == sa2);
+	return (l1 == l2 && !memcmp(sa1, sa2, l1));
+}
+
+static struct vbp_target *
+vbp_find(const struct vbp_target *nvt, const struct backend *b)
+{
+	struct vbp_target *vt;
+
+	VTAILQ_FOREACH(vt, &vbp_list, list) {
+		CHECK_OBJ_NOTNULL(vt, VBP_TARGET_MAGIC);
+		if (strcmp(vt->req, nvt->req) ||
+		    vt->probe.timeout != nvt->probe.timeout ||
+		    vt->probe.interval != nvt->probe.interval ||
+		    vt->probe.window != nvt->probe.window ||
+		    vt->probe.threshold != nvt->probe.threshold)
+			continue;
+		if (!vbp_same_addr(vt->ipv4, vt->ipv4len, b->ipv4, b->ipv4len))
+			continue;
+		if (!vbp_same_addr(vt->ipv6, vt->ipv6len, b->ipv6, b->ipv6len))
+			continue;
+		return (vt);
+	}
+	return (NULL);
+}
+
+static void
+vbp_copy_addr(struct sockaddr **sa, socklen_t *len,
+    const struct sockaddr *src, socklen_t srclen)
+{
+
+	if (src == NULL)
+		return;
+	*sa = malloc(srclen);
+	XXXAN(*sa);
+	memcpy(*sa, src, srclen);
+	*len = srclen;
+}
+
+static void
+vbp_free_target(struct vbp_target *vt)
+{
+
+	free(vt->req);
+	free(vt->ipv4);
+	free(vt->ipv6);
+	FREE_OBJ(vt);
+}
+
+/*--------------------------------------------------------------------
+ * Join the probe of someone probing the same thing, or start a new one.
+ * The addresses of the backend can change under us, unless we hold its
+ * lock, see cache_backend_resolve.c
+ */
+
+static void
+vbp_attach(struct vbp_target *vt, struct backend *b)
+{
+	struct vbp_target *vt2;
+
+	Lck_Lock(&b->mtx);
+	vt2 = vbp_find(vt, b);
+	if (vt2 != NULL) {
+		/* Someone is already probing this, join in */
+		Lck_Unlock(&b->mtx);
+		vbp_free_target(vt);
+		Lck_Lock(&vbp_mtx);
+		VTAILQ_INSERT_TAIL(&vt2->backends, b, probe_list);
+		b->health = vt2->health;
+		b->t_healthy = vt2->t_healthy;
+		b->healthy = vt2->healthy;
+		Lck_Unlock(&vbp_mtx);
+		b->probe = vt2;
+		return;
+	}
+	vbp_copy_addr(&vt->ipv4, &vt->ipv4len, b->ipv4, b->ipv4len);
+	vbp_copy_addr(&vt->ipv6, &vt->ipv6len, b->ipv6, b->ipv6len);
+	Lck_Unlock(&b->mtx);
+
+	printf("Probe(\"%s\", %g, %g)\n",
+	    vt->req,
+	    vt->probe.timeout,
+	    vt->probe.interval);
+
+	VTAILQ_INIT(&vt->backends);
+	VTAILQ_INSERT_TAIL(&vt->backends, b, probe_list);
+	b->probe = vt;
+
+	VTAILQ_INSERT_TAIL(&vbp_list, vt, list);
+	VSL_stats->n_probe++;
+
+	assert(write(vbp_pipe[1], &vt, sizeof vt) == sizeof vt);
+}
+
 /*--------------------------------------------------------------------
  * Start/Stop called from cache_backend_cfg.c
  */
@@ -416,9 +736,9 @@ VBP_Start(struct backend *b, struct vrt_backend_probe const *p)
 		FREE_OBJ(vt);
 		/* No probe defined for this backend, set it healthy */
 		b->healthy = 1;
+		b->health = 1.0;
 		return;
 	}
-	vt->backend = b;
 	vt->probe = *p;
 
 	if(p->request != NULL) {
@@ -440,19 +760,67 @@ VBP_Start(struct backend *b, struct vrt_backend_probe const *p)
 		vsb_delete(vsb);
 	}
 	vt->req_len = strlen(vt->req);
+	vt->fd = -1;
 
-	b->probe = vt;
+	/*
+	 * Establish defaults
+	 * XXX: we could make these defaults parameters
+	 */
+	if (vt->probe.request == NULL)
+		vt->probe.request = default_request;
+	if (vt->probe.timeout == 0.0)
+		vt->probe.timeout = 2.0;
+	if (vt->probe.interval == 0.0)
+		vt->probe.interval = 5.0;
+	if (vt->probe.window == 0)
+		vt->probe.window = 8;
+	if (vt->probe.threshold == 0)
+		vt->probe.threshold = 3;
 
-	VTAILQ_INSERT_TAIL(&vbp_list, vt, list);
+	vbp_attach(vt, b);
+}
+
+/*--------------------------------------------------------------------
+ * The addresses of the backend were looked up again and changed, so
+ * move it to a probe of the new ones.  The new probe inherits the
+ * history of the old one, so a healthy backend is not taken sick for
+ * a whole window just because it moved.
+ */
 
-	AZ(pthread_create(&vt->thread, NULL, vbp_wrk_poll_backend, vt));
+void
+VBP_Readdress(struct backend *b)
+{
+	struct vbp_target *vt, *nvt;
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	ASSERT_CLI();
+	if (b->probe == NULL)
+		return;
+	CAST_OBJ_NOTNULL(vt, b->probe, VBP_TARGET_MAGIC);
+
+	ALLOC_OBJ(nvt, VBP_TARGET_MAGIC);
+	XXXAN(nvt);
+	nvt->probe = vt->probe;
+	nvt->req = strdup(vt->req);
+	XXXAN(nvt->req);
+	nvt->req_len = vt->req_len;
+	nvt->fd = -1;
+	nvt->happy = vt->happy;
+	nvt->good = vt->good;
+	nvt->avg = vt->avg;
+	nvt->rate = vt->rate;
+	nvt->healthy = vt->healthy;
+	nvt->health = vt->health;
+	nvt->t_healthy = vt->t_healthy;
+
+	VBP_Stop(b);
+	vbp_attach(nvt, b);
 }
 
 void
 VBP_Stop(struct backend *b)
 {
 	struct vbp_target *vt;
-	void *ret;
 
 	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
 
@@ -462,13 +830,23 @@ VBP_Stop(struct backend *b)
 	CHECK_OBJ_NOTNULL(b->probe, VBP_TARGET_MAGIC);
 	vt = b->probe;
 
+	Lck_Lock(&vbp_mtx);
+	VTAILQ_REMOVE(&vt->backends, b, probe_list);
+	b->probe = NULL;
+	if (!VTAILQ_EMPTY(&vt->backends)) {
+		/* Others still use it */
+		Lck_Unlock(&vbp_mtx);
+		return;
+	}
 	vt->stop = 1;
-	AZ(pthread_cancel(vt->thread));
-	AZ(pthread_join(vt->thread, &ret));
+	assert(write(vbp_pipe[1], &vt, sizeof vt) == sizeof vt);
+	while (!vt->stopped)
+		Lck_CondWait(&vbp_cond, &vbp_mtx);
+	Lck_Unlock(&vbp_mtx);
 
 	VTAILQ_REMOVE(&vbp_list, vt, list);
-	b->probe = NULL;
-	FREE_OBJ(vt);
+	VSL_stats->n_probe--;
+	vbp_free_target(vt);
 }
 
 /*--------------------------------------------------------------------
@@ -479,5 +857,9 @@ void
 VBP_Init(void)
 {
 
+	Lck_New(&vbp_mtx);
+	AZ(pthread_cond_init(&vbp_cond, NULL));
+	AZ(pipe(vbp_pipe));
+	AZ(pthread_create(&vbp_thread, NULL, vbp_wrk_poll, NULL));
 	CLI_AddFuncs(DEBUG_CLI, debug_cmds);
 }
@@ -0,0 +1,306 @@
+/*-
+ * Copyright (c) 2009 Alex Kritikos
+ * All rights reserved.
+ *
+ * Author: Alex Kritikos <alex.kritikos@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Look up the addresses of backends again.
+ *
+ * The VCL compiler looks up the .host of a backend when the VCL is
+ * compiled, so if the name moves to another address, during a failover
+ * for instance, we keep connecting to the old one until a new VCL is
+ * loaded.
+ *
+ * Every params->backend_resolve_interval seconds this thread looks up
+ * the backends again, and if the addresses changed, swaps the new ones
+ * in under the backend's lock.  vbe_open() copies the addresses under
+ * the same lock, so the old ones can be freed right away.  The CLI
+ * command backend.resolve marks backends as due and wakes this thread,
+ * so that a slow name server never holds up the CLI thread.
+ *
+ * Like the VCL compiler, we use the first IPv4 and the first IPv6
+ * address found, and if the lookup fails, we keep the ones we have.
+ *
+ * Probes are started, stopped and shared between backends by address
+ * in the CLI thread, so VBE_Poll() moves the probe of a backend which
+ * got new addresses, the backend just flags that it needs doing.
+ */
+
+#include "config.h"
+
+#include "svnid.h"
+SVNID("$Id$")
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+
+#include <sys/socket.h>
+
+#include "shmlog.h"
+#include "cache.h"
+#include "cache_backend.h"
+
+/* How often we look for backends which are due */
+#define RESOLVE_TICK		1.0
+
+static pthread_t vbr_thread;
+static struct lock vbr_mtx;
+static pthread_cond_t vbr_cond = PTHREAD_COND_INITIALIZER;
+
+/* Protected by vbr_mtx */
+static VTAILQ_HEAD(, backend) vbr_backends =
+    VTAILQ_HEAD_INITIALIZER(vbr_backends);
+static unsigned vbr_requested;
+
+/*--------------------------------------------------------------------
+ * Backends come and go in the CLI thread.
+ */
+
+void
+VBR_AddBackend(struct backend *b)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	AN(b->hostname);
+	AN(b->portname);
+	Lck_Lock(&vbr_mtx);
+	b->t_resolved = TIM_real();
+	VTAILQ_INSERT_TAIL(&vbr_backends, b, resolve_list);
+	Lck_Unlock(&vbr_mtx);
+}
+
+void
+VBR_DelBackend(struct backend *b)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	Lck_Lock(&vbr_mtx);
+	VTAILQ_REMOVE(&vbr_backends, b, resolve_list);
+	Lck_Unlock(&vbr_mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Look up a host and port, this may take a long time.
+ */
+
+struct vbr_addr {
+	struct sockaddr_storage	ss4;
+	socklen_t		l4;
+	struct sockaddr_storage	ss6;
+	socklen_t		l6;
+};
+
+static int
+vbr_lookup(const char *host, const char *port, struct vbr_addr *va,
+    const char **err)
+{
+	struct addrinfo hint, *res, *res0;
+	int error;
+
+	memset(va, 0, sizeof *va);
+	memset(&hint, 0, sizeof hint);
+	hint.ai_family = PF_UNSPEC;
+	hint.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(host, port, &hint, &res0);
+	if (error) {
+		*err = gai_strerror(error);
+		return (-1);
+	}
+	for (res = res0; res != NULL; res = res->ai_next) {
+		if (res->ai_family == PF_INET && va->l4 == 0) {
+			assert(res->ai_addrlen <= sizeof va->ss4);
+			memcpy(&va->ss4, res->ai_addr, res->ai_addrlen);
+			va->l4 = res->ai_addrlen;
+		} else if (res->ai_family == PF_INET6 && va->l6 == 0) {
+			assert(res->ai_addrlen <= sizeof va->ss6);
+			memcpy(&va->ss6, res->ai_addr, res->ai_addrlen);
+			va->l6 = res->ai_addrlen;
+		}
+	}
+	freeaddrinfo(res0);
+	if (va->l4 == 0 && va->l6 == 0) {
+		*err = "Resolves to neither IPv4 nor IPv6 addresses";
+		return (-1);
+	}
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Swap in the new addresses, if they are different.
+ */
+
+static int
+vbr_same(const struct sockaddr *sa, socklen_t salen,
+    const struct sockaddr_storage *ss, socklen_t sslen)
+{
+
+	if (sa == NULL || sslen == 0)
+		return (sa == NULL && sslen == 0);
+	return (salen == sslen && !memcmp(sa, ss, salen));
+}
+
+static void
+vbr_copy(struct sockaddr **sa, socklen_t *salen,
+    const struct sockaddr_storage *ss, socklen_t sslen)
+{
+
+	free(*sa);
+	*sa = NULL;
+	*salen = 0;
+	if (sslen == 0)
+		return;
+	*sa = malloc(sslen);
+	XXXAN(*sa);
+	memcpy(*sa, ss, sslen);
+	*salen = sslen;
+}
+
+static int
+vbr_swap(struct backend *b, const struct vbr_addr *va)
+{
+	int retval = 0;
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	Lck_Lock(&b->mtx);
+	if (!vbr_same(b->ipv4, b->ipv4len, &va->ss4, va->l4) ||
+	    !vbr_same(b->ipv6, b->ipv6len, &va->ss6, va->l6)) {
+		vbr_copy(&b->ipv4, &b->ipv4len, &va->ss4, va->l4);
+		vbr_copy(&b->ipv6, &b->ipv6len, &va->ss6, va->l6);
+		b->readdressed = 1;
+		retval = 1;
+	}
+	Lck_Unlock(&b->mtx);
+	if (retval) {
+		VSL(SLT_Debug, 0, "Backend %s: %s new address",
+		    b->vcl_name, b->hostname);
+		VSL_stats->backend_readdress++;
+	}
+	return (retval);
+}
+
+/*--------------------------------------------------------------------
+ * Have the resolver thread look up a backend again as soon as it can,
+ * under a new host name if one is given.  The backend keeps that name
+ * until it goes away.
+ */
+
+void
+VBR_Request(struct backend *b, const char *host)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	ASSERT_CLI();
+	AN(b->hostname);
+	Lck_Lock(&vbr_mtx);
+	/* vbr_resolver() notices this, if it was looking up the old name */
+	if (host != NULL && strcmp(host, b->hostname))
+		REPLACE(b->hostname, host);
+	b->resolve_now = 1;
+	vbr_requested = 1;
+	AZ(pthread_cond_signal(&vbr_cond));
+	Lck_Unlock(&vbr_mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Find a backend which is due, and take a copy of its names, so that we
+ * can look it up without holding vbr_mtx.
+ */
+
+static struct backend *
+vbr_next(double now, char **host, char **port)
+{
+	struct backend *b;
+
+	Lck_Lock(&vbr_mtx);
+	VTAILQ_FOREACH(b, &vbr_backends, resolve_list) {
+		CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+		if (b->resolve_now)
+			break;
+		if (params->backend_resolve_interval > 0. &&
+		    now - b->t_resolved >= params->backend_resolve_interval)
+			break;
+	}
+	if (b != NULL) {
+		b->t_resolved = now;
+		b->resolve_now = 0;
+		*host = strdup(b->hostname);
+		XXXAN(*host);
+		*port = strdup(b->portname);
+		XXXAN(*port);
+	}
+	Lck_Unlock(&vbr_mtx);
+	return (b);
+}
+
+static void *
+vbr_resolver(void *priv)
+{
+	struct backend *b, *b2;
+	struct vbr_addr va;
+	const char *err;
+	char *host, *port;
+	int i;
+
+	THR_SetName("backend resolve");
+	(void)priv;
+	while (1) {
+		Lck_Lock(&vbr_mtx);
+		if (!vbr_requested)
+			(void)Lck_CondTimedWait(&vbr_cond, &vbr_mtx,
+			    TIM_real() + RESOLVE_TICK);
+		vbr_requested = 0;
+		Lck_Unlock(&vbr_mtx);
+		while ((b = vbr_next(TIM_real(), &host, &port)) != NULL) {
+			i = vbr_lookup(host, port, &va, &err);
+			if (i)
+				VSL(SLT_Debug, 0, "Backend %s:%s lookup: %s",
+				    host, port, err);
+			Lck_Lock(&vbr_mtx);
+			/* It may have gone away while we looked it up */
+			VTAILQ_FOREACH(b2, &vbr_backends, resolve_list)
+				if (b2 == b)
+					break;
+			if (i == 0 && b2 != NULL &&
+			    !strcmp(b->hostname, host) &&
+			    !strcmp(b->portname, port))
+				(void)vbr_swap(b, &va);
+			Lck_Unlock(&vbr_mtx);
+			free(host);
+			free(port);
+		}
+	}
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+void
+VBR_Init(void)
+{
+
+	Lck_New(&vbr_mtx);
+	AZ(pthread_create(&vbr_thread, NULL, vbr_resolver, NULL));
+}
@@ -0,0 +1,378 @@
+/*-
+ * Copyright (c) 2009 Alex Kritikos
+ * All rights reserved.
+ *
+ * Author: Alex Kritikos <alex.kritikos@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * A consistent hashing director with bounded load.
+ *
+ * Every member is given a number of points on a ring of 32 bit hash
+ * values, proportional to its weight.  A request is sent to the member
+ * owning the first point at or after the first 32 bits of its object
+ * digest, so the same objects keep going to the same backend, and
+ * adding or removing a member only moves the objects it owned.
+ *
+ * To stop a few popular objects from swamping their backend, a member
+ * is passed over if it already has more than .load_factor times its
+ * fair share of the connections, and we walk on along the ring to the
+ * next member which has room.  See "Consistent Hashing with Bounded
+ * Loads" by Mirrokni, Thorup and Zadimoghaddam.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shmlog.h"
+#include "cache.h"
+#include "cache_backend.h"
+#include "hash_slinger.h"
+#include "vsha256.h"
+#include "vrt.h"
+
+/*--------------------------------------------------------------------*/
+
+#define HASH_POINTS		64	/* Points per unit of weight */
+
+struct vdi_hash_host {
+	struct backend		*backend;
+	double			weight;
+};
+
+struct vdi_hash_point {
+	uint32_t		point;
+	unsigned		host;
+};
+
+struct vdi_hash {
+	unsigned		magic;
+#define VDI_HASH_MAGIC		0x3a0ce5d1
+	struct director		dir;
+
+	unsigned		retries;
+	double			load_factor;
+	struct vdi_hash_host	*hosts;
+	unsigned		nhosts;
+	struct vdi_hash_point	*points;
+	unsigned		npoints;
+};
+
+/*--------------------------------------------------------------------*/
+
+static uint32_t
+vdi_hash_u32(const unsigned char *p)
+{
+
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+static int
+vdi_hash_cmp(const void *a, const void *b)
+{
+	const struct vdi_hash_point *pa = a, *pb = b;
+
+	if (pa->point < pb->point)
+		return (-1);
+	if (pa->point > pb->point)
+		return (1);
+	return ((int)pa->host - (int)pb->host);
+}
+
+/*--------------------------------------------------------------------
+ * A host can be picked if it is healthy, not full and we have not
+ * already failed to get a connection to it for this request.
+ */
+
+static int
+vdi_hash_usable(const struct vdi_hash *vs, const unsigned char *skip, int i)
+{
+	const struct backend *bp;
+
+	if (skip != NULL && skip[i])
+		return (0);
+	bp = vs->hosts[i].backend;
+	if (!bp->healthy)
+		return (0);
+	if (bp->max_conn == 0 || bp->n_conn < bp->max_conn)
+		return (1);
+	return (!VTAILQ_EMPTY(&bp->connlist));
+}
+
+/*--------------------------------------------------------------------
+ * Without a digest (pass and pipe) there is nothing to be consistent
+ * about, so we simply pick the usable host with the lowest load.
+ */
+
+static int
+vdi_hash_least_busy(const struct vdi_hash *vs, const unsigned char *skip)
+{
+	int b, i;
+	double l, lb;
+
+	b = -1;
+	lb = 0.0;
+	for (i = 0; i < vs->nhosts; i++) {
+		if (!vdi_hash_usable(vs, skip, i))
+			continue;
+		l = (vs->hosts[i].backend->n_conn + 1) / vs->hosts[i].weight;
+		if (b == -1 || l < lb) {
+			b = i;
+			lb = l;
+		}
+	}
+	return (b);
+}
+
+/*--------------------------------------------------------------------
+ * Walk the ring from the point of the digest, and take the first host
+ * which is usable and below its share of the load.
+ *
+ * The share of a host is its part of the total weight of the usable
+ * hosts times the number of connections they would have with this
+ * one added, times the .load_factor, rounded up.  As the shares add
+ * up to at least the total, some host always has room.
+ */
+
+static int
+vdi_hash_pick(const struct vdi_hash *vs, const unsigned char *skip,
+    const unsigned char *digest)
+{
+	uint32_t key;
+	unsigned lo, hi, mid, j, i;
+	double tw, tc, cap;
+
+	if (digest == NULL || vs->npoints == 0)
+		return (vdi_hash_least_busy(vs, skip));
+
+	tw = 0.0;
+	tc = 1.0;
+	for (i = 0; i < vs->nhosts; i++) {
+		if (!vdi_hash_usable(vs, skip, i))
+			continue;
+		tw += vs->hosts[i].weight;
+		tc += vs->hosts[i].backend->n_conn;
+	}
+	if (tw == 0.0)
+		return (-1);
+
+	key = vdi_hash_u32(digest);
+	lo = 0;
+	hi = vs->npoints;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (vs->points[mid].point < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (j = 0; j < vs->npoints; j++) {
+		i = vs->points[(lo + j) % vs->npoints].host;
+		if (!vdi_hash_usable(vs, skip, i))
+			continue;
+		cap = ceil(vs->load_factor * tc * vs->hosts[i].weight / tw);
+		if (vs->hosts[i].backend->n_conn + 1 <= cap)
+			return (i);
+	}
+	return (vdi_hash_least_busy(vs, skip));
+}
+
+/*--------------------------------------------------------------------
+ * If we fail to get a connection to the chosen backend, we mark it in
+ * a skip-map and walk on to the next one, up to .retries times.
+ */
+
+static struct vbe_conn *
+vdi_hash_getfd(struct sess *sp)
+{
+	int b, k;
+	struct vdi_hash *vs;
+	struct vbe_conn *vbe;
+	const unsigned char *digest;
+	unsigned char *skip;
+	char *snap;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(sp->director, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, sp->director->priv, VDI_HASH_MAGIC);
+
+	digest = NULL;
+	if (sp->objhead != NULL) {
+		CHECK_OBJ_NOTNULL(sp->objhead, OBJHEAD_MAGIC);
+		digest = sp->objhead->digest;
+	}
+
+	vbe = NULL;
+	skip = NULL;
+	snap = NULL;
+	for (k = 0; k < vs->retries; k++) {
+		b = vdi_hash_pick(vs, skip, digest);
+		if (b == -1)
+			break;
+		vbe = VBE_GetVbe(sp, vs->hosts[b].backend);
+		if (vbe != NULL)
+			break;
+		if (skip == NULL) {
+			snap = WS_Snapshot(sp->wrk->ws);
+			skip = (void*)WS_Alloc(sp->wrk->ws, vs->nhosts);
+			if (skip == NULL)
+				break;
+			memset(skip, 0, vs->nhosts);
+		}
+		skip[b] = 1;
+	}
+	if (skip != NULL)
+		WS_Reset(sp->wrk->ws, snap);
+	return (vbe);
+}
+
+static unsigned
+vdi_hash_healthy(const struct sess *sp)
+{
+	struct vdi_hash *vs;
+	int i;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(sp->director, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, sp->director->priv, VDI_HASH_MAGIC);
+
+	for (i = 0; i < vs->nhosts; i++) {
+		if (vs->hosts[i].backend->healthy)
+			return 1;
+	}
+	return 0;
+}
+
+/*lint -e{818} not const-able */
+static void
+vdi_hash_fini(struct director *d)
+{
+	int i;
+	struct vdi_hash *vs;
+	struct vdi_hash_host *vh;
+
+	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, d->priv, VDI_HASH_MAGIC);
+
+	vh = vs->hosts;
+	for (i = 0; i < vs->nhosts; i++, vh++)
+		VBE_DropRef(vh->backend);
+	free(vs->hosts);
+	free(vs->points);
+	free(vs->dir.vcl_name);
+	vs->dir.magic = 0;
+	FREE_OBJ(vs);
+}
+
+/*--------------------------------------------------------------------
+ * The points of a host are derived from its backend identity, so that
+ * the same backend ends up in the same places on the ring in all VCLs
+ * and all varnish instances.
+ */
+
+void
+VRT_init_dir_hash(struct cli *cli, struct director **bp,
+    const struct vrt_dir_hash *t)
+{
+	struct vdi_hash *vs;
+	const struct vrt_dir_hash_entry *te;
+	struct vdi_hash_host *vh;
+	struct vdi_hash_point *vp;
+	struct SHA256Context ctx;
+	unsigned char sign[SHA256_LEN];
+	char buf[16];
+	unsigned n, u;
+	int i;
+
+	(void)cli;
+
+	ALLOC_OBJ(vs, VDI_HASH_MAGIC);
+	XXXAN(vs);
+	vs->hosts = calloc(sizeof *vh, t->nmember);
+	XXXAN(vs->hosts);
+
+	vs->dir.magic = DIRECTOR_MAGIC;
+	vs->dir.priv = vs;
+	vs->dir.name = "hash";
+	REPLACE(vs->dir.vcl_name, t->name);
+	vs->dir.getfd = vdi_hash_getfd;
+	vs->dir.fini = vdi_hash_fini;
+	vs->dir.healthy = vdi_hash_healthy;
+
+	vs->retries = t->retries;
+	if (vs->retries == 0)
+		vs->retries = t->nmember;
+	vs->load_factor = t->load_factor;
+	if (vs->load_factor < 1.0)
+		vs->load_factor = 1.25;
+
+	n = 0;
+	vh = vs->hosts;
+	te = t->members;
+	for (i = 0; i < t->nmember; i++, vh++, te++) {
+		assert(te->weight >= 0.0);
+		vh->weight = te->weight;
+		if (vh->weight == 0.0)
+			vh->weight = 1.0;
+		vh->backend = VBE_AddBackend(cli, te->host);
+		n += (unsigned)(vh->weight * HASH_POINTS);
+	}
+	vs->nhosts = t->nmember;
+
+	vs->points = calloc(sizeof *vp, n == 0 ? 1 : n);
+	XXXAN(vs->points);
+	vp = vs->points;
+	vh = vs->hosts;
+	te = t->members;
+	for (i = 0; i < t->nmember; i++, vh++, te++) {
+		for (u = 0; u < (unsigned)(vh->weight * HASH_POINTS); u++) {
+			SHA256_Init(&ctx);
+			SHA256_Update(&ctx, te->host->ident,
+			    strlen(te->host->ident));
+			assert(snprintf(buf, sizeof buf, "#%u", u) <
+			    sizeof buf);
+			SHA256_Update(&ctx, buf, strlen(buf));
+			SHA256_Final(sign, &ctx);
+			vp->point = vdi_hash_u32(sign);
+			vp->host = i;
+			vp++;
+		}
+	}
+	vs->npoints = n;
+	qsort(vs->points, vs->npoints, sizeof *vs->points, vdi_hash_cmp);
+
+	*bp = &vs->dir;
+}
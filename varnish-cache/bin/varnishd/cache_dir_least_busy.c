@@ -51,6 +51,8 @@
 
 struct vdi_least_busy_host {
 	struct backend		*backend;
+	double			weight;
+	struct varnish_dirstat	*stats;
 };
 
 struct vdi_least_busy {
@@ -58,38 +60,231 @@ struct vdi_least_busy {
 #define VDI_LEAST_BUSY_MAGIC	0x12dbaf45
 	struct director		dir;
 
+	unsigned		policy;
+	unsigned		retries;
 	struct vdi_least_busy_host	*hosts;
 	unsigned		nhosts;
+	unsigned		next_host;
+
+	struct lock		mtx;
+	unsigned		queue_length;
+	double			queue_timeout;
+	unsigned		nqueued;
+
+	double			slow_start;
+
+	double			eject_threshold;
+	double			eject_time;
 };
 
-static struct vbe_conn *
-vdi_least_busy_getfd(struct sess *sp)
+/*--------------------------------------------------------------------
+ * The load of a host is the number of connections it would have if we
+ * picked it, scaled down by its weight, so that a host with weight 4
+ * is considered as busy as a host with weight 1 with a quarter of the
+ * connections.
+ *
+ * The weight is also scaled by the health score of the backend, so that
+ * one which answers its probes slowly, or only some of them, gets less
+ * traffic than one which is doing fine.
+ *
+ * During the .slow_start period after a backend comes back healthy,
+ * its weight ramps up linearly from (almost) nothing, so that it is
+ * not handed all new requests just because it has no connections.
+ *
+ * With the latency policy, this is further multiplied by the average
+ * time to first byte of the backend, approximating how long the new
+ * request would have to wait.  Backends we have no measurements for
+ * yet come out as idle, so that they get tried.
+ */
+
+#define SLOW_START_MIN		0.01
+
+static double
+vdi_least_busy_load(const struct vdi_least_busy *vs,
+    const struct vdi_least_busy_host *vh)
+{
+	double l, w, r;
+
+	w = vh->weight * vh->backend->health;
+	if (vs->slow_start > 0.0) {
+		r = (TIM_real() - vh->backend->t_healthy) / vs->slow_start;
+		if (r < SLOW_START_MIN)
+			r = SLOW_START_MIN;
+		if (r < 1.0)
+			w *= r;
+	}
+	l = (vh->backend->n_conn + 1) / w;
+	if (vs->policy == VRT_LEAST_BUSY_LATENCY)
+		l *= vh->backend->ttfb_avg;
+	return (l);
+}
+
+/*--------------------------------------------------------------------
+ * A backend is full if it has reached its .max_connections and has no
+ * idle connections we could reuse.
+ */
+
+static int
+vdi_least_busy_full(const struct backend *bp)
+{
+
+	if (bp->max_conn == 0 || bp->n_conn < bp->max_conn)
+		return (0);
+	return (VTAILQ_EMPTY(&bp->connlist));
+}
+
+/*--------------------------------------------------------------------
+ * A host is ejected if at least .eject_threshold of its recent fetches
+ * failed, and the last failure is less than .eject_time ago.  Once
+ * that time has passed, it gets to try again, and either the error
+ * rate starts going down, or it is ejected again right away.
+ */
+
+static int
+vdi_least_busy_ejected(const struct vdi_least_busy *vs,
+    const struct backend *bp)
+{
+
+	if (vs->eject_threshold <= 0.0 || bp->err_avg < vs->eject_threshold)
+		return (0);
+	return (TIM_real() - bp->t_err < vs->eject_time);
+}
+
+/*--------------------------------------------------------------------
+ * A host can be picked if it is healthy, not full and we have not
+ * already failed to get a connection to it for this request, and,
+ * if eject is set, it is not ejected.
+ */
+
+static int
+vdi_least_busy_usable(const struct vdi_least_busy *vs,
+    const unsigned char *skip, int i, int eject)
+{
+
+	if (skip != NULL && skip[i])
+		return (0);
+	if (!vs->hosts[i].backend->healthy) {
+		vs->hosts[i].stats->unhealthy++;
+		return (0);
+	}
+	if (eject && vdi_least_busy_ejected(vs, vs->hosts[i].backend)) {
+		vs->hosts[i].stats->ejected++;
+		return (0);
+	}
+	return (!vdi_least_busy_full(vs->hosts[i].backend));
+}
+
+/*--------------------------------------------------------------------
+ * Find the least-busy, usable backend by examining all of them.
+ *
+ * Ties are common, in particular when the director is idle, so each
+ * scan starts one host further along than the previous, to spread
+ * them evenly instead of always favouring the first host.  The cursor
+ * is not locked, it is only a hint.
+ */
+
+static int
+vdi_least_busy_scan(struct vdi_least_busy *vs, const unsigned char *skip,
+    int eject)
+{
+	int b, i, j, tie;
+	unsigned start;
+	double l, lb;
+
+	if (vs->nhosts == 0)
+		return (-1);
+	start = vs->next_host;
+	vs->next_host = (start + 1) % vs->nhosts;
+
+	b = -1;
+	lb = 0.0;
+	tie = 0;
+	for (j = 0; j < vs->nhosts; j++) {
+		i = (start + j) % vs->nhosts;
+		if (!vdi_least_busy_usable(vs, skip, i, eject))
+			continue;
+		l = vdi_least_busy_load(vs, &vs->hosts[i]);
+		if (b == -1 || l < lb) {
+			b = i;
+			lb = l;
+			tie = 0;
+		} else if (l == lb)
+			tie = 1;
+	}
+	if (tie)
+		vs->hosts[b].stats->tie++;
+	return (b);
+}
+
+/*--------------------------------------------------------------------
+ * "Power of two choices": pick two different members at random and use
+ * the less busy of them.  This is constant time no matter how many
+ * members the director has, and since concurrent sessions are unlikely
+ * to draw the same pair, they do not all pile onto the same backend
+ * before its n_conn has been bumped.
+ *
+ * If neither of the two is usable we fall back to a full scan.
+ */
+
+static int
+vdi_least_busy_p2c(struct vdi_least_busy *vs, const unsigned char *skip,
+    int eject)
+{
+	int a, b;
+	double la, lb;
+
+	if (vs->nhosts < 2)
+		return (vdi_least_busy_scan(vs, skip, eject));
+	a = random() % vs->nhosts;
+	b = random() % (vs->nhosts - 1);
+	if (b >= a)
+		b++;
+	if (!vdi_least_busy_usable(vs, skip, a, eject))
+		a = -1;
+	if (!vdi_least_busy_usable(vs, skip, b, eject))
+		b = -1;
+	if (a == -1 && b == -1)
+		return (vdi_least_busy_scan(vs, skip, eject));
+	if (a == -1)
+		return (b);
+	if (b == -1)
+		return (a);
+	la = vdi_least_busy_load(vs, &vs->hosts[a]);
+	lb = vdi_least_busy_load(vs, &vs->hosts[b]);
+	if (lb < la)
+		return (b);
+	if (lb == la)
+		vs->hosts[a].stats->tie++;
+	return (a);
+}
+
+static int
+vdi_least_busy_choose(struct vdi_least_busy *vs, const unsigned char *skip,
+    int eject)
+{
+
+	switch (vs->policy) {
+	case VRT_LEAST_BUSY_P2C:
+		return (vdi_least_busy_p2c(vs, skip, eject));
+	default:
+		return (vdi_least_busy_scan(vs, skip, eject));
+	}
+}
+
+/*--------------------------------------------------------------------
+ * Ejecting all the hosts would only make matters worse, so if nothing
+ * is left, we ignore the ejections.
+ */
+
+static int
+vdi_least_busy_pick(struct vdi_least_busy *vs, const unsigned char *skip)
 {
-  int b, i, n1, n2;
-  struct vdi_least_busy *vs;
-  struct vbe_conn *vbe;
-
-  CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
-  CHECK_OBJ_NOTNULL(sp->director, DIRECTOR_MAGIC);
-  CAST_OBJ_NOTNULL(vs, sp->director->priv, VDI_LEAST_BUSY_MAGIC);
-
-
-  /* Find the least-busy, healthy backend */
-  n1 = -1;
-  b = 0;
-  for (i = 0; i < vs->nhosts; i++) {
-    if (vs->hosts[i].backend->healthy) {
-      n2 = vs->hosts[i].backend->n_conn;
-      if (n1 == -1 || n2 < n1) {
-        b = i;
-        n1 = n2;
-      }
-    }
-  }
-  vbe = VBE_GetVbe(sp, vs->hosts[b].backend);
-  if (vbe != NULL)
-    return (vbe);
-  return (NULL);
+	int b;
+
+	b = vdi_least_busy_choose(vs, skip, 1);
+	if (b == -1 && vs->eject_threshold > 0.0)
+		b = vdi_least_busy_choose(vs, skip, 0);
+	return (b);
 }
 
 static unsigned
@@ -109,6 +304,109 @@ vdi_least_busy_healthy(const struct sess *sp)
 	return 0;
 }
 
+/*--------------------------------------------------------------------
+ * When all the healthy backends are full, we let up to .queue_length
+ * sessions wait up to .queue_timeout for one of them to free up.
+ *
+ * Connections are released in cache_backend.c which knows nothing
+ * about directors, it just wakes everybody who waits for a release, see
+ * VBE_WatchRelease(), and we look again.
+ */
+
+static int
+vdi_least_busy_queue(const struct sess *sp, struct vdi_least_busy *vs)
+{
+	double deadline, tmo;
+	unsigned gen;
+	int b;
+
+	if (vs->queue_length == 0)
+		return (-1);
+	if (!vdi_least_busy_healthy(sp))
+		return (-1);
+
+	Lck_Lock(&vs->mtx);
+	if (vs->nqueued >= vs->queue_length) {
+		Lck_Unlock(&vs->mtx);
+		VSL_stats->backend_queue_fail++;
+		return (-1);
+	}
+	vs->nqueued++;
+	Lck_Unlock(&vs->mtx);
+	VSL_stats->backend_queue++;
+
+	tmo = vs->queue_timeout;
+	if (tmo <= 0.0)
+		tmo = sp->connect_timeout;
+	deadline = TIM_real() + tmo;
+	gen = VBE_WatchRelease();
+	do
+		b = vdi_least_busy_pick(vs, NULL);
+	while (b == -1 && !VBE_WaitRelease(&gen, deadline));
+	VBE_UnwatchRelease();
+
+	Lck_Lock(&vs->mtx);
+	vs->nqueued--;
+	Lck_Unlock(&vs->mtx);
+	if (b == -1)
+		VSL_stats->backend_queue_fail++;
+	return (b);
+}
+
+/*--------------------------------------------------------------------
+ * If we fail to get a connection to the chosen backend, we mark it in
+ * a skip-map and try the next least busy one, up to .retries times.
+ * The skip-map lives on the workspace, and is only allocated once the
+ * first attempt has failed.
+ *
+ * The connection we hand out is marked with the statistics of the
+ * member, so that cache_backend.c can tell when it is done with it.
+ */
+
+static struct vbe_conn *
+vdi_least_busy_getfd(struct sess *sp)
+{
+	int b, k;
+	struct vdi_least_busy *vs;
+	struct vbe_conn *vbe;
+	unsigned char *skip;
+	char *snap;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(sp->director, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, sp->director->priv, VDI_LEAST_BUSY_MAGIC);
+
+	vbe = NULL;
+	skip = NULL;
+	snap = NULL;
+	for (k = 0; k < vs->retries; k++) {
+		b = vdi_least_busy_pick(vs, skip);
+		if (b == -1 && skip == NULL)
+			b = vdi_least_busy_queue(sp, vs);
+		if (b == -1)
+			break;
+		vs->hosts[b].stats->select++;
+		vbe = VBE_GetVbe(sp, vs->hosts[b].backend);
+		if (vbe != NULL) {
+			vbe->dirstat = vs->hosts[b].stats;
+			(void)Atomic_Inc(&vbe->dirstat->inflight);
+			break;
+		}
+		vs->hosts[b].stats->fail++;
+		if (skip == NULL) {
+			snap = WS_Snapshot(sp->wrk->ws);
+			skip = (void*)WS_Alloc(sp->wrk->ws, vs->nhosts);
+			if (skip == NULL)
+				break;
+			memset(skip, 0, vs->nhosts);
+		}
+		skip[b] = 1;
+	}
+	if (skip != NULL)
+		WS_Reset(sp->wrk->ws, snap);
+	return (vbe);
+}
+
 /*lint -e{818} not const-able */
 static void
 vdi_least_busy_fini(struct director *d)
@@ -121,10 +419,13 @@ vdi_least_busy_fini(struct director *d)
 	CAST_OBJ_NOTNULL(vs, d->priv, VDI_LEAST_BUSY_MAGIC);
 
 	vh = vs->hosts;
-	for (i = 0; i < vs->nhosts; i++, vh++)
+	for (i = 0; i < vs->nhosts; i++, vh++) {
+		VSL_DirStatDel(vh->stats);
 		VBE_DropRef(vh->backend);
+	}
 	free(vs->hosts);
 	free(vs->dir.vcl_name);
+	Lck_Delete(&vs->mtx);
 	vs->dir.magic = 0;
 	FREE_OBJ(vs);
 }
@@ -153,10 +454,28 @@ VRT_init_dir_least_busy(struct cli *cli, struct director **bp,
 	vs->dir.fini = vdi_least_busy_fini;
 	vs->dir.healthy = vdi_least_busy_healthy;
 
+	vs->policy = t->policy;
+	vs->retries = t->retries;
+	if (vs->retries == 0)
+		vs->retries = t->nmember;
+	Lck_New(&vs->mtx);
+	vs->queue_length = t->queue_length;
+	vs->queue_timeout = t->queue_timeout;
+	vs->slow_start = t->slow_start;
+	vs->eject_threshold = t->eject_threshold;
+	vs->eject_time = t->eject_time;
+	if (vs->eject_time <= 0.0)
+		vs->eject_time = 10.0;
 	vh = vs->hosts;
 	te = t->members;
-	for (i = 0; i < t->nmember; i++, vh++, te++)
+	for (i = 0; i < t->nmember; i++, vh++, te++) {
+		assert(te->weight >= 0.0);
+		vh->weight = te->weight;
+		if (vh->weight == 0.0)
+			vh->weight = 1.0;
 		vh->backend = VBE_AddBackend(cli, te->host);
+		vh->stats = VSL_DirStatNew(t->name, vh->backend->vcl_name);
+	}
 	vs->nhosts = t->nmember;
 
 	*bp = &vs->dir;
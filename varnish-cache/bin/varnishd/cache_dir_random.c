@@ -64,10 +64,29 @@ struct vdi_random {
 	unsigned		nhosts;
 };
 
+/*--------------------------------------------------------------------
+ * The share of a backend is its weight, scaled by its health score and
+ * divided among the connections it already has.
+ */
+
+static double
+vdi_random_share(const struct vdi_random_host *vh)
+{
+
+	return (vh->weight * vh->backend->health /
+	    ((double)vh->backend->n_conn + 1));
+}
+
+/*--------------------------------------------------------------------
+ * The n_conn of the backends may change while we look at them, so the
+ * second pass may not end up with the same sum as the first.  If we
+ * run off the end, we use the last healthy backend.
+ */
+
 static struct vbe_conn *
 vdi_random_getfd(struct sess *sp)
 {
-	int i, k;
+	int i, j, k;
 	struct vdi_random *vs;
 	double r, s1;
 	struct vbe_conn *vbe;
@@ -82,7 +101,7 @@ vdi_random_getfd(struct sess *sp)
 		s1 = 0.0;
 		for (i = 0; i < vs->nhosts; i++)
 			if (vs->hosts[i].backend->healthy)
-                          s1 += vs->hosts[i].weight / ((double) vs->hosts[i].backend->n_conn + 1);
+				s1 += vdi_random_share(&vs->hosts[i]);
 
 		if (s1 == 0.0)
 			return (NULL);
@@ -93,16 +112,19 @@ vdi_random_getfd(struct sess *sp)
 		r *= s1;
 
 		s1 = 0.0;
+		j = -1;
 		for (i = 0; i < vs->nhosts; i++)  {
 			if (!vs->hosts[i].backend->healthy)
 				continue;
-			s1 += vs->hosts[i].weight / ((double) vs->hosts[i].backend->n_conn + 1);
-			if (r >= s1)
-				continue;
-			vbe = VBE_GetVbe(sp, vs->hosts[i].backend);
+			j = i;
+			s1 += vdi_random_share(&vs->hosts[i]);
+			if (r < s1)
+				break;
+		}
+		if (j >= 0) {
+			vbe = VBE_GetVbe(sp, vs->hosts[j].backend);
 			if (vbe != NULL)
 				return (vbe);
-			break;
 		}
 		k++;
 	}
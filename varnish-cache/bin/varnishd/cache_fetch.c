@@ -42,6 +42,7 @@ SVNID("$Id$")
 #include "cache.h"
 #include "stevedore.h"
 #include "cli_priv.h"
+#include "cache_backend.h"
 
 static unsigned fetchfrag;
 
@@ -306,16 +307,86 @@ FetchReqBody(struct sess *sp)
 	return (0);
 }
 
+/*--------------------------------------------------------------------
+ * Only GET requests without a body may share a backend connection with
+ * others, see cache_backend_pipeline.c
+ */
+
+static int
+fetch_pipelinable(const struct sess *sp)
+{
+
+	if (strcmp(http_GetReq(sp->wrk->bereq), "GET"))
+		return (0);
+	if (http_GetHdr(sp->http, H_Content_Length, NULL) ||
+	    http_GetHdr(sp->http, H_Transfer_Encoding, NULL))
+		return (0);
+	return (1);
+}
+
+/*--------------------------------------------------------------------
+ * Send the request, and on a shared connection, wait for our turn to
+ * read the response.  Those before us get between_bytes_timeout to
+ * write their requests, and first_byte_timeout to read their responses.
+ * Returns -1 if the shared connection broke, or we gave up, before then.
+ */
+
+static int
+fetch_send(struct sess *sp)
+{
+	struct vbe_conn *vc;
+	struct worker *w;
+	int i;
+
+	w = sp->wrk;
+	vc = sp->vbe;
+
+	TCP_blocking(vc->fd);	/* XXX: we should timeout instead */
+	if (vc->pipeline != NULL &&
+	    VBL_WaitWrite(vc, TIM_real() + sp->between_bytes_timeout)) {
+		VBE_ClosedFd(sp);
+		return (-1);
+	}
+	WRW_Reserve(w, &vc->fd);
+	(void)http_Write(w, w->bereq, 0);	/* XXX: stats ? */
+
+	/* Deal with any message-body the request might have */
+	i = FetchReqBody(sp);
+	i = (WRW_FlushRelease(w) || i > 0);
+	if (vc->pipeline != NULL)
+		VBL_Written(vc, !i);
+	if (i) {
+		VBE_ClosedFd(sp);
+		/* XXX: other cleanup ? */
+		return (__LINE__);
+	}
+
+	/* Checkpoint the shmlog here */
+	WSL_Flush(w, 0);
+
+	/* XXX is this the right place? */
+	VSL_stats->backend_req++;
+
+	if (vc->pipeline != NULL &&
+	    VBL_WaitRead(vc, TIM_real() + sp->first_byte_timeout)) {
+		VBE_ClosedFd(sp);
+		return (-1);
+	}
+	return (0);
+}
+
 /*--------------------------------------------------------------------*/
 
 int
 FetchHdr(struct sess *sp)
 {
 	struct vbe_conn *vc;
+	struct backend *bp;
 	struct worker *w;
 	char *b;
 	struct http *hp;
-	int i;
+	int i, retry;
+	double t_req;
 
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 	CHECK_OBJ_NOTNULL(sp->wrk, WORKER_MAGIC);
@@ -332,10 +403,13 @@ FetchHdr(struct sess *sp)
 	w = sp->wrk;
 	hp = sp->wrk->bereq;
 
+	sp->pipelinable = fetch_pipelinable(sp);
 	VBE_GetFd(sp);
+	sp->pipelinable = 0;
 	if (sp->vbe == NULL)
 		return (__LINE__);
 	vc = sp->vbe;
+	bp = vc->backend;
 	/* Inherit the backend timeouts from the selected backend */
 	SES_InheritBackendTimeouts(sp);
 
@@ -347,35 +421,52 @@ FetchHdr(struct sess *sp)
 	if (!http_GetHdr(hp, H_Host, &b))
 		VBE_AddHostHeader(sp);
 
-	TCP_blocking(vc->fd);	/* XXX: we should timeout instead */
-	WRW_Reserve(w, &vc->fd);
-	(void)http_Write(w, hp, 0);	/* XXX: stats ? */
+	for (retry = 0; ; retry++) {
+		if (retry) {
+			/*
+			 * The shared connection broke before we got our
+			 * response, or we got tired of waiting for it, send
+			 * the request again on a connection of our own.
+			 */
+			VSL_stats->backend_pipeline_retry++;
+			sp->vbe = VBE_GetVbe(sp, bp);
+			if (sp->vbe == NULL)
+				return (__LINE__);
+			vc = sp->vbe;
+		}
+		i = fetch_send(sp);
+		if (i < 0)
+			continue;
+		if (i > 0)
+			return (i);
+
+		/* Receive response */
+
+		t_req = TIM_real();
+		HTC_Init(w->htc, w->ws, vc->fd);
+		i = 0;
+		if (vc->pipeline != NULL)
+			i = VBL_Prefill(vc, w->htc);
+		TCP_set_read_timeout(vc->fd, sp->first_byte_timeout);
+		while (i == 0) {
+			i = HTC_Rx(w->htc);
+			TCP_set_read_timeout(vc->fd, sp->between_bytes_timeout);
+		}
 
-	/* Deal with any message-body the request might have */
-	i = FetchReqBody(sp);
-	if (WRW_FlushRelease(w) || i > 0) {
-		VBE_ClosedFd(sp);
-		/* XXX: other cleanup ? */
-		return (__LINE__);
+		/* The backend closed after the response before ours */
+		if (i == -1 && vc->pipeline != NULL && vc->seq > 0 &&
+		    w->htc->rxbuf.b == w->htc->rxbuf.e) {
+			VBE_ClosedFd(sp);
+			continue;
+		}
+		break;
 	}
 
-	/* Checkpoint the shmlog here */
-	WSL_Flush(w, 0);
-
-	/* XXX is this the right place? */
-	VSL_stats->backend_req++;
-
-	/* Receive response */
-
-	HTC_Init(sp->wrk->htc, sp->wrk->ws, vc->fd);
-	TCP_set_read_timeout(vc->fd, sp->first_byte_timeout);
-	do {
-		i = HTC_Rx(sp->wrk->htc);
-		TCP_set_read_timeout(vc->fd, sp->between_bytes_timeout);
-	}
-	while (i == 0);
+	/* A timeout counts as a (very) slow response */
+	VBE_UpdateTtfb(vc, TIM_real() - t_req);
 
 	if (i < 0) {
+		VBE_UpdateErr(vc, 1);
 		VBE_ClosedFd(sp);
 		/* XXX: other cleanup ? */
 		return (__LINE__);
@@ -384,10 +475,14 @@ FetchHdr(struct sess *sp)
 	hp = sp->wrk->beresp;
 
 	if (http_DissectResponse(sp->wrk, sp->wrk->htc, hp)) {
+		VBE_UpdateErr(vc, 1);
 		VBE_ClosedFd(sp);
 		/* XXX: other cleanup ? */
 		return (__LINE__);
 	}
+	if (vc->pipeline != NULL)
+		VBL_Response(vc, hp);
+	VBE_UpdateErr(vc, hp->status >= 500);
 	return (0);
 }
 
@@ -38,6 +38,7 @@
 #include "svnid.h"
 SVNID("$Id$")
 
+#include <errno.h>
 #include <stdio.h>
 
 #include <pthread.h>
@@ -157,6 +158,54 @@ Lck_CondWait(pthread_cond_t *cond, struct lock *lck)
 	ilck->owner = pthread_self();
 }
 
+/*
+ * As Lck_CondWait(), but give up at 'when', on the TIM_real() timescale.
+ * Returns ETIMEDOUT if we did, zero otherwise.
+ */
+
+int
+Lck_CondTimedWait(pthread_cond_t *cond, struct lock *lck, double when)
+{
+	struct ilck *ilck;
+	struct timespec ts;
+	int i;
+
+	CAST_OBJ_NOTNULL(ilck, lck->priv, ILCK_MAGIC);
+	AN(ilck->held);
+	assert(pthread_equal(ilck->owner, pthread_self()));
+	ts.tv_sec = (time_t)when;
+	ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+	if (ts.tv_nsec >= 1000000000L)
+		ts.tv_nsec = 999999999L;
+	ilck->held = 0;
+	i = pthread_cond_timedwait(cond, &ilck->mtx, &ts);
+	assert(i == 0 || i == ETIMEDOUT || i == EINTR);
+	AZ(ilck->held);
+	ilck->held = 1;
+	ilck->owner = pthread_self();
+	return (i == ETIMEDOUT ? ETIMEDOUT : 0);
+}
+
+#ifndef HAVE_SYNC_BUILTINS
+/*
+ * Fallback for Atomic_Inc() and Atomic_Dec(), if the compiler cannot
+ * do it for us.
+ */
+
+static pthread_mutex_t		atomic_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned
+Lck__AtomicAdd(volatile unsigned *p, int d)
+{
+	unsigned u;
+
+	AZ(pthread_mutex_lock(&atomic_mtx));
+	u = (*p += d);
+	AZ(pthread_mutex_unlock(&atomic_mtx));
+	return (u);
+}
+#endif
+
 void
 Lck__New(struct lock *lck, const char *w)
 {
@@ -118,7 +118,9 @@ child_main(void)
 	SES_Init();
 
 	VBE_Init();
+	VBI_Init();
 	VBP_Init();
+	VBR_Init();
 	WRK_Init();
 
 	EXP_Init();
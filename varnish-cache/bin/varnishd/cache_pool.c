@@ -38,6 +38,30 @@
  * The algorithm for when to create threads needs to be reactive enough
  * to handle startup spikes, but sufficiently attenuated to not cause
  * thread pileups.  This remains subject for improvement.
+ *
+ * Pools help each other out: work goes to an idle thread in another pool
+ * rather than wait in an overflow queue, workers take work from other
+ * pools' overflow queues before they go idle, and work is only dropped
+ * when the overflow queues of all pools are full.
+ *
+ * With params->wthread_affinity the CPUs are divided between the pools,
+ * each pool's threads are pinned to its CPUs, and work is queued to the
+ * pool whose thread ran it last, rather than round robin.  The acceptor
+ * and waiter threads are not pinned, the CPU they happen to run on says
+ * nothing about where the session's data is, so new sessions are still
+ * spread round robin, and stay with their pool after that.
+ *
+ * With params->wthread_latency, the pools are also sized to keep the time
+ * work waits for a thread under that target, see wrk_pace_flock().
+ *
+ * With params->wthread_lockfree, work is handed over through a bounded
+ * lock free ring in each pool, and idle threads sleep on the pool's
+ * semaphore, so that neither side takes the pool's mutex.
+ *
+ * The workspaces of the worker threads are not on their stacks, but in
+ * an anonymous mapping of their own, so that the stacks can be kept to
+ * params->wthread_stacksize, and the pages are only faulted in as they
+ * are used and go back to the kernel when the thread does.
  */
 
 #include "config.h"
@@ -46,8 +70,10 @@
 SVNID("$Id$")
 
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -62,13 +88,35 @@ SVNID("$Id$")
 #include "hash_slinger.h"
 #include "vsha256.h"
 
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP)
+#include <sched.h>
+#define WRK_AFFINITY
+#endif
+
+#if defined(HAVE_SYNC_BUILTINS) && defined(HAVE_SEM_INIT)
+#include <semaphore.h>
+#define WRK_LOCKFREE
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0 /* XXX FreeBSD */
+#endif
+
 VTAILQ_HEAD(workerhead, worker);
 
+#ifdef WRK_LOCKFREE
+struct wrk_cell {
+	volatile unsigned	seq;
+	struct workreq		*wrq;
+};
+#endif
+
 /* Number of work requests queued in excess of worker threads available */
 
 struct wq {
 	unsigned		magic;
 #define WQ_MAGIC		0x606658fa
+	unsigned		idx;
 	struct lock		mtx;
 	struct workerhead	idle;
 	VTAILQ_HEAD(, workreq)	overflow;
@@ -77,6 +125,26 @@ struct wq {
 	unsigned		lqueue;
 	uintmax_t		ndrop;
 	uintmax_t		noverflow;
+	uintmax_t		nsteal;
+	/* Time work waited for a thread, see wrk_pace_flock() */
+	double			sumlat;
+	unsigned		nlat;
+	double			lat;
+	unsigned		nwant;
+	/* Idle threads, and the fewest since wrk_decimate_flock() looked */
+	unsigned		lidle;
+	unsigned		minidle;
+#ifdef WRK_LOCKFREE
+	/* Lock free mode, see wrk_lf_*() */
+	struct wrk_cell		*ring;
+	unsigned		lring;
+	volatile unsigned	head;
+	volatile unsigned	tail;
+	volatile unsigned	nidle;
+	volatile unsigned	nwake;
+	sem_t			sem;
+	double			t_full;
+#endif
 };
 
 static struct wq		**wq;
@@ -88,6 +156,71 @@ static pthread_cond_t		herder_cond;
 static struct lock		herder_mtx;
 static struct lock		wstat_mtx;
 
+#ifdef WRK_LOCKFREE
+/* Snapshot of params->wthread_lockfree, it cannot change under us */
+static unsigned			lockfree;
+/* Queued to make a thread go away */
+static struct workreq		wrk_retire;
+#endif
+
+#ifdef WRK_AFFINITY
+/* The CPUs we may run on, in order */
+static unsigned			ncpu;
+static int			cpus[CPU_SETSIZE];
+#endif
+
+/*--------------------------------------------------------------------
+ * The CPUs are divided between the pools in order, so that neighbouring
+ * CPUs, which are more likely to share caches and memory, share a pool.
+ */
+
+#ifdef WRK_AFFINITY
+
+static void
+wrk_cpu_init(void)
+{
+	cpu_set_t set;
+	int c;
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof set, &set))
+		return;
+	for (c = 0; c < CPU_SETSIZE; c++)
+		if (CPU_ISSET(c, &set))
+			cpus[ncpu++] = c;
+}
+
+/* Pin the calling thread to the CPUs served by its pool */
+
+static void
+wrk_cpu_pin(const struct wq *qp)
+{
+	cpu_set_t set;
+	unsigned u, n, lo, hi;
+	int i;
+
+	CHECK_OBJ_NOTNULL(qp, WQ_MAGIC);
+	if (ncpu == 0)
+		return;
+	n = nwq;
+	lo = (qp->idx * ncpu + n - 1) / n;
+	hi = ((qp->idx + 1) * ncpu + n - 1) / n;
+	if (lo >= hi) {
+		/* More pools than CPUs, share one */
+		lo = (qp->idx * ncpu) / n;
+		hi = lo + 1;
+	}
+	CPU_ZERO(&set);
+	for (u = lo; u < hi && u < ncpu; u++)
+		CPU_SET(cpus[u], &set);
+	i = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	if (i)
+		VSL(SLT_Debug, 0, "Pinning worker thread failed %d %s",
+		    i, strerror(i));
+}
+
+#endif
+
 /*--------------------------------------------------------------------*/
 
 static void
@@ -113,36 +246,398 @@ WRK_SumStat(const struct worker *w)
 	Lck_Unlock(&wstat_mtx);
 }
 
+/*--------------------------------------------------------------------
+ * Take the first request off another pool's overflow queue, if any.
+ */
+
+static struct workreq *
+wrk_steal(const struct wq *qp)
+{
+	struct wq *qp2;
+	struct workreq *wrq = NULL;
+	unsigned u, n;
+
+	n = nwq;
+	for (u = 1; u < n && wrq == NULL; u++) {
+		qp2 = wq[(qp->idx + u) % n];
+		CHECK_OBJ_NOTNULL(qp2, WQ_MAGIC);
+		if (qp2->nqueue == 0)		/* Unlocked peek */
+			continue;
+		Lck_Lock(&qp2->mtx);
+		wrq = VTAILQ_FIRST(&qp2->overflow);
+		if (wrq != NULL) {
+			VTAILQ_REMOVE(&qp2->overflow, wrq, list);
+			qp2->nqueue--;
+			qp2->nsteal++;
+		}
+		Lck_Unlock(&qp2->mtx);
+	}
+	return (wrq);
+}
+
+/*--------------------------------------------------------------------
+ * Lock free mode.
+ *
+ * Each pool has a bounded multi-producer multi-consumer ring of work
+ * requests.  Every cell carries a sequence number, which tells both
+ * sides whether it is theirs to fill or empty for the current lap, so
+ * the head and tail can be claimed with a compare-and-swap each.
+ *
+ * qp->nidle counts the threads which found the ring empty and sleep on
+ * the pool's semaphore.  Whoever queues work takes one off the count
+ * before it posts, and threads count themselves in before they have a
+ * last look at the ring, so neither a request nor a wakeup is lost.
+ * Every count taken off is paid for with exactly one post, also when
+ * the ring turns out to be full and the thread wakes up to nothing.  A
+ * thread which finds work on that last look takes itself off the count
+ * again, and if somebody beat it to that, it eats the post made for it,
+ * so qp->nidle never counts a thread which is not asleep or about to be.
+ *
+ * Requests on the ring which a thread has been woken for are not
+ * waiting for a thread, qp->nwake counts those when we need to know
+ * how much is really queued.
+ */
+
+#ifdef WRK_LOCKFREE
+
+static unsigned
+wrk_lf_ringsize(void)
+{
+	uintmax_t l;
+	unsigned u;
+
+	/* Room for all the threads and their overflow, see ovfl_max */
+	l = params->wthread_max;
+	l += (l * params->overflow_max) / 100;
+	for (u = 64; u < l && u < (1U << 20); u <<= 1)
+		continue;
+	return (u);
+}
+
+static void
+wrk_lf_init(struct wq *qp)
+{
+	unsigned u;
+
+	qp->lring = wrk_lf_ringsize();
+	qp->ring = calloc(sizeof *qp->ring, qp->lring);
+	XXXAN(qp->ring);
+	for (u = 0; u < qp->lring; u++)
+		qp->ring[u].seq = u;
+	AZ(sem_init(&qp->sem, 0, 0));
+}
+
+static int
+wrk_lf_push(struct wq *qp, struct workreq *wrq)
+{
+	struct wrk_cell *c;
+	unsigned pos;
+	int d;
+
+	pos = qp->head;
+	while (1) {
+		c = &qp->ring[pos & (qp->lring - 1)];
+		d = (int)(c->seq - pos);
+		if (d < 0)
+			return (0);		/* Full */
+		if (d == 0 &&
+		    __sync_bool_compare_and_swap(&qp->head, pos, pos + 1))
+			break;
+		pos = qp->head;
+	}
+	c->wrq = wrq;
+	__sync_synchronize();
+	c->seq = pos + 1;
+	return (1);
+}
+
+static struct workreq *
+wrk_lf_pop(struct wq *qp)
+{
+	struct wrk_cell *c;
+	struct workreq *wrq;
+	unsigned pos;
+	int d;
+
+	pos = qp->tail;
+	while (1) {
+		c = &qp->ring[pos & (qp->lring - 1)];
+		d = (int)(c->seq - (pos + 1));
+		if (d < 0)
+			return (NULL);		/* Empty */
+		if (d == 0 &&
+		    __sync_bool_compare_and_swap(&qp->tail, pos, pos + 1))
+			break;
+		pos = qp->tail;
+	}
+	wrq = c->wrq;
+	__sync_synchronize();
+	c->seq = pos + qp->lring;
+	return (wrq);
+}
+
+static unsigned
+wrk_lf_nqueue(const struct wq *qp)
+{
+	unsigned l, w;
+
+	l = qp->head - qp->tail;
+	w = qp->nwake;
+	return (l > w ? l - w : 0);
+}
+
+static void
+wrk_lf_post(struct wq *qp)
+{
+
+	(void)Atomic_Inc(&qp->nwake);
+	AZ(sem_post(&qp->sem));
+}
+
+/* Take one off a counter, unless it is zero */
+
+static int
+wrk_lf_claim(volatile unsigned *p)
+{
+	unsigned u;
+
+	do {
+		u = *p;
+		if (u == 0)
+			return (0);
+	} while (!__sync_bool_compare_and_swap(p, u, u - 1));
+	return (1);
+}
+
+/*
+ * Take a thread off the idle count, and keep track of how few there
+ * were.  That is racy, but only a hint for wrk_decimate_flock().
+ */
+
+static int
+wrk_lf_unidle(struct wq *qp)
+{
+	unsigned u;
+
+	if (!wrk_lf_claim(&qp->nidle))
+		return (0);
+	u = qp->nidle;
+	if (u < qp->minidle)
+		qp->minidle = u;
+	return (1);
+}
+
+/* Wake one idle thread, if there is any */
+
+static void
+wrk_lf_wake(struct wq *qp)
+{
+
+	if (qp->nidle > 0 && wrk_lf_unidle(qp))
+		wrk_lf_post(qp);
+}
+
+static struct workreq *
+wrk_lf_steal(const struct wq *qp)
+{
+	struct wq *qp2;
+	struct workreq *wrq = NULL;
+	unsigned u, n;
+
+	n = nwq;
+	for (u = 1; u < n && wrq == NULL; u++) {
+		qp2 = wq[(qp->idx + u) % n];
+		CHECK_OBJ_NOTNULL(qp2, WQ_MAGIC);
+		if (qp2->head == qp2->tail)
+			continue;
+		wrq = wrk_lf_pop(qp2);
+		if (wrq == &wrk_retire) {
+			/* Not ours to act on, put it back */
+			if (wrk_lf_push(qp2, wrq))
+				wrk_lf_wake(qp2);
+			wrq = NULL;
+		} else if (wrq != NULL)
+			qp2->nsteal++;
+	}
+	return (wrq);
+}
+
+static int
+wrk_lf_queue(struct wq *qp, struct workreq *wrq)
+{
+	struct wq *qp2;
+	unsigned u, n;
+
+	/* An idle thread in our own pool, or failing that, another pool */
+	n = nwq;
+	for (u = 0; u < n; u++) {
+		qp2 = wq[(qp->idx + u) % n];
+		CHECK_OBJ_NOTNULL(qp2, WQ_MAGIC);
+		if (qp2->nidle == 0 || !wrk_lf_unidle(qp2))
+			continue;
+		if (wrk_lf_push(qp2, wrq)) {
+			if (u > 0)
+				qp2->nsteal++;
+			wrk_lf_post(qp2);
+			return (0);
+		}
+		/* Ring full, we owe the thread its post all the same */
+		wrk_lf_post(qp2);
+	}
+
+	/* Queue it, on another pool's ring if ours is full */
+	for (u = 0; u < n; u++) {
+		qp2 = wq[(qp->idx + u) % n];
+		if (wrk_lf_nqueue(qp2) > ovfl_max || !wrk_lf_push(qp2, wrq))
+			continue;
+		qp2->noverflow++;
+		if (u > 0)
+			qp2->nsteal++;
+		qp2->t_full = TIM_real();
+		/* A thread may have gone idle in the meantime */
+		wrk_lf_wake(qp2);
+		AZ(pthread_cond_signal(&herder_cond));
+		return (0);
+	}
+
+	/* If all pools have too much in the overflow already, refuse. */
+	qp->ndrop++;
+	return (-1);
+}
+
+/* Make an idle thread go away, if there is one */
+
+static int
+wrk_lf_retire(struct wq *qp)
+{
+
+	if (!wrk_lf_unidle(qp))
+		return (0);
+	if (!wrk_lf_push(qp, &wrk_retire)) {
+		wrk_lf_post(qp);
+		return (0);
+	}
+	wrk_lf_post(qp);
+	return (1);
+}
+
+static unsigned wrk_do(struct wq *qp, struct worker *w);
+
+static unsigned
+wrk_lf_loop(struct worker *w, struct wq *qp)
+{
+	unsigned stats_clean = 0;
+
+	while (1) {
+		CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+		w->wrq = wrk_lf_pop(qp);
+		if (w->wrq == NULL && nwq > 1)
+			w->wrq = wrk_lf_steal(qp);
+		if (w->wrq == NULL) {
+			if (isnan(w->lastused))
+				w->lastused = TIM_real();
+			if (!stats_clean) {
+				WRK_SumStat(w);
+				stats_clean = 1;
+			}
+			(void)Atomic_Inc(&qp->nidle);
+			w->wrq = wrk_lf_pop(qp);
+			if (w->wrq == NULL) {
+				while (sem_wait(&qp->sem))
+					assert(errno == EINTR);
+				(void)Atomic_Dec(&qp->nwake);
+				continue;
+			}
+			if (!wrk_lf_unidle(qp)) {
+				/* Counted out already, take the post */
+				while (sem_wait(&qp->sem))
+					assert(errno == EINTR);
+				(void)Atomic_Dec(&qp->nwake);
+			}
+		}
+		if (w->wrq == &wrk_retire)
+			break;
+		stats_clean = wrk_do(qp, w);
+	}
+	w->wrq = NULL;
+	return (stats_clean);
+}
+
+#endif
+
 /*--------------------------------------------------------------------*/
 
-static void *
-wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace)
+static unsigned
+wrk_nqueue(const struct wq *qp)
+{
+
+#ifdef WRK_LOCKFREE
+	if (lockfree)
+		return (wrk_lf_nqueue(qp));
+#endif
+	return (qp->nqueue);
+}
+
+static unsigned
+wrk_nidle_flock(const struct wq *qp)
+{
+
+	Lck_AssertHeld(&qp->mtx);
+#ifdef WRK_LOCKFREE
+	if (lockfree)
+		return (qp->nidle);
+#endif
+	return (qp->lidle);
+}
+
+/*--------------------------------------------------------------------
+ * Run the request we were given, and clean up after it.
+ * Returns non-zero if our statistics were summed.
+ */
+
+static unsigned
+wrk_do(struct wq *qp, struct worker *w)
 {
-	struct worker *w, ww;
-	unsigned char wlog[shm_workspace];
-	unsigned char ws[sess_workspace];
-	struct SHA256Context sha256;
-	struct dstat stats;
 	unsigned stats_clean = 0;
 
-	THR_SetName("cache-worker");
-	w = &ww;
-	memset(w, 0, sizeof *w);
-	memset(&stats, 0, sizeof stats);
-	w->magic = WORKER_MAGIC;
-	w->stats = &stats;
+	AN(w->wrq);
+	AN(w->wrq->func);
+	/* Sloppy, but a lost sample here and there does not matter */
+	qp->sumlat += TIM_real() - w->wrq->t_queue;
+	qp->nlat++;
 	w->lastused = NAN;
-	w->wlb = w->wlp = wlog;
-	w->wle = wlog + sizeof wlog;
-	w->sha256ctx = &sha256;
-	AZ(pthread_cond_init(&w->cond, NULL));
+	WS_Reset(w->ws, NULL);
+	w->bereq = NULL;
+	w->beresp1 = NULL;
+	w->beresp = NULL;
+	w->resp = NULL;
+	w->wrq->pool = qp->idx + 1;
+	w->wrq->func(w, w->wrq->priv);
+	AZ(w->bereq);
+	AZ(w->beresp1);
+	AZ(w->beresp);
+	AZ(w->resp);
+	WS_Assert(w->ws);
+	AZ(w->wfd);
+	assert(w->wlp == w->wlb);
+	w->wrq = NULL;
+	if (!Lck_Trylock(&wstat_mtx)) {
+		wrk_sumstat(w);
+		stats_clean = 1;
+		Lck_Unlock(&wstat_mtx);
+	}
+	return (stats_clean);
+}
 
-	WS_Init(w->ws, "wrk", ws, sess_workspace);
+/*--------------------------------------------------------------------*/
 
-	VSL(SLT_WorkThread, 0, "%p start", w);
+static unsigned
+wrk_loop(struct worker *w, struct wq *qp)
+{
+	unsigned stats_clean = 0;
+	unsigned stole = 0;
 
 	Lck_Lock(&qp->mtx);
-	qp->nthr++;
 	while (1) {
 		CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
 
@@ -151,10 +646,19 @@ wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace)
 		if (w->wrq != NULL) {
 			VTAILQ_REMOVE(&qp->overflow, w->wrq, list);
 			qp->nqueue--;
+		} else if (!stole && nwq > 1) {
+			/* Help the other pools out before going idle */
+			stole = 1;
+			Lck_Unlock(&qp->mtx);
+			w->wrq = wrk_steal(qp);
+			Lck_Lock(&qp->mtx);
+			if (w->wrq == NULL)
+				continue;
 		} else {
 			if (isnan(w->lastused))
 				w->lastused = TIM_real();
 			VTAILQ_INSERT_HEAD(&qp->idle, w, list);
+			qp->lidle++;
 			if (!stats_clean) {
 				WRK_SumStat(w);
 				stats_clean = 1;
@@ -164,31 +668,92 @@ wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace)
 		if (w->wrq == NULL)
 			break;
 		Lck_Unlock(&qp->mtx);
-		AN(w->wrq);
-		AN(w->wrq->func);
-		w->lastused = NAN;
-		stats_clean = 0;
-		WS_Reset(w->ws, NULL);
-		w->bereq = NULL;
-		w->beresp1 = NULL;
-		w->beresp = NULL;
-		w->resp = NULL;
-		w->wrq->func(w, w->wrq->priv);
-		AZ(w->bereq);
-		AZ(w->beresp1);
-		AZ(w->beresp);
-		AZ(w->resp);
-		WS_Assert(w->ws);
-		AZ(w->wfd);
-		assert(w->wlp == w->wlb);
-		w->wrq = NULL;
-		if (!Lck_Trylock(&wstat_mtx)) {
-			wrk_sumstat(w);
-			stats_clean = 1;
-			Lck_Unlock(&wstat_mtx);
-		}
+		stole = 0;
+		stats_clean = wrk_do(qp, w);
 		Lck_Lock(&qp->mtx);
 	}
+	Lck_Unlock(&qp->mtx);
+	return (stats_clean);
+}
+
+/* Where the SHA256 context goes, suitably aligned after the workspaces */
+
+static size_t
+wrk_arena_sha256(unsigned shm_workspace, unsigned sess_workspace)
+{
+	size_t l;
+
+	l = (size_t)sess_workspace + shm_workspace;
+	return ((l + sizeof(double) - 1) & ~(sizeof(double) - 1));
+}
+
+/*--------------------------------------------------------------------
+ * Map the session workspace, the shmlog buffer and the SHA256 context
+ * of a worker thread, in that order.  The mapping is not reserved or
+ * touched here, so the pages are only faulted in as the workspaces are
+ * used, and where the kernel can, in huge pages.
+ */
+
+static unsigned char *
+wrk_arena_new(size_t *lp, unsigned shm_workspace, unsigned sess_workspace)
+{
+	unsigned char *p;
+	size_t l, ps;
+
+	ps = getpagesize();
+	l = wrk_arena_sha256(shm_workspace, sess_workspace) +
+	    sizeof(struct SHA256Context);
+	l = (l + ps - 1) & ~(ps - 1);
+	p = mmap(NULL, l, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	xxxassert(p != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+	(void)madvise(p, l, MADV_HUGEPAGE);
+#endif
+	*lp = l;
+	return (p);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void *
+wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace)
+{
+	struct worker *w, ww;
+	unsigned char *arena;
+	size_t arena_len;
+	struct dstat stats;
+	unsigned stats_clean;
+
+	THR_SetName("cache-worker");
+	arena = wrk_arena_new(&arena_len, shm_workspace, sess_workspace);
+	w = &ww;
+	memset(w, 0, sizeof *w);
+	memset(&stats, 0, sizeof stats);
+	w->magic = WORKER_MAGIC;
+	w->stats = &stats;
+	w->lastused = NAN;
+	w->wlb = w->wlp = arena + sess_workspace;
+	w->wle = w->wlb + shm_workspace;
+	w->sha256ctx = (void *)
+	    (arena + wrk_arena_sha256(shm_workspace, sess_workspace));
+	VTAILQ_INIT(&w->vbe_conns);
+	AZ(pthread_cond_init(&w->cond, NULL));
+
+	WS_Init(w->ws, "wrk", arena, sess_workspace);
+
+	VSL(SLT_WorkThread, 0, "%p start", w);
+
+	Lck_Lock(&qp->mtx);
+	qp->nthr++;
+	Lck_Unlock(&qp->mtx);
+#ifdef WRK_LOCKFREE
+	if (lockfree)
+		stats_clean = wrk_lf_loop(w, qp);
+	else
+#endif
+		stats_clean = wrk_loop(w, qp);
+	Lck_Lock(&qp->mtx);
 	qp->nthr--;
 	Lck_Unlock(&qp->mtx);
 	AN(stats_clean);
@@ -198,7 +763,9 @@ wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace)
 		VCL_Rel(&w->vcl);
 	AZ(pthread_cond_destroy(&w->cond));
 	HSH_Cleanup(w);
+	VBE_Cleanup(w);
 	WRK_SumStat(w);
+	AZ(munmap(arena, arena_len));
 	return (NULL);
 }
 
@@ -208,6 +775,10 @@ wrk_thread(void *priv)
 	struct wq *qp;
 
 	CAST_OBJ_NOTNULL(qp, priv, WQ_MAGIC);
+#ifdef WRK_AFFINITY
+	if (params->wthread_affinity)
+		wrk_cpu_pin(qp);
+#endif
 	/* We need to snapshot these two for consistency */
 	return (wrk_thread_real(qp,
 	    params->shm_workspace,
@@ -215,55 +786,116 @@ wrk_thread(void *priv)
 }
 
 /*--------------------------------------------------------------------
- * Queue a workrequest if possible.
- *
- * Return zero if the request was queued, negative if it wasn't.
+ * Hand a request to an idle thread in a pool, or put it on the pool's
+ * overflow queue, if there is room.  Return non-zero if we did.
  */
 
-int
-WRK_Queue(struct workreq *wrq)
+static int
+wrk_tickle(struct wq *qp, struct workreq *wrq, int steal)
 {
 	struct worker *w;
-	struct wq *qp;
-	static unsigned nq = 0;
-	unsigned onq;
-
-	/*
-	 * Select which pool we issue to
-	 * XXX: better alg ?
-	 * XXX: per CPU ?
-	 */
-	onq = nq + 1;
-	if (onq >= nwq)
-		onq = 0;
-	qp = wq[onq];
-	nq = onq;
 
 	Lck_Lock(&qp->mtx);
-
-	/* If there are idle threads, we tickle the first one into action */
 	w = VTAILQ_FIRST(&qp->idle);
-	if (w != NULL) {
-		VTAILQ_REMOVE(&qp->idle, w, list);
+	if (w == NULL) {
 		Lck_Unlock(&qp->mtx);
-		w->wrq = wrq;
-		AZ(pthread_cond_signal(&w->cond));
 		return (0);
 	}
+	VTAILQ_REMOVE(&qp->idle, w, list);
+	if (--qp->lidle < qp->minidle)
+		qp->minidle = qp->lidle;
+	if (steal)
+		qp->nsteal++;
+	Lck_Unlock(&qp->mtx);
+	w->wrq = wrq;
+	AZ(pthread_cond_signal(&w->cond));
+	return (1);
+}
+
+static int
+wrk_overflow(struct wq *qp, struct workreq *wrq, int steal)
+{
 
-	/* If we have too much in the overflow already, refuse. */
+	Lck_Lock(&qp->mtx);
 	if (qp->nqueue > ovfl_max) {
-		qp->ndrop++;
 		Lck_Unlock(&qp->mtx);
-		return (-1);
+		return (0);
 	}
-
 	VTAILQ_INSERT_TAIL(&qp->overflow, wrq, list);
 	qp->noverflow++;
 	qp->nqueue++;
+	if (steal)
+		qp->nsteal++;
 	Lck_Unlock(&qp->mtx);
 	AZ(pthread_cond_signal(&herder_cond));
-	return (0);
+	return (1);
+}
+
+/*--------------------------------------------------------------------
+ * Queue a workrequest if possible.
+ *
+ * Return zero if the request was queued, negative if it wasn't.
+ */
+
+int
+WRK_Queue(struct workreq *wrq)
+{
+	struct wq *qp, *qp2;
+	static unsigned nq = 0;
+	unsigned onq, u, n;
+
+	wrq->t_queue = TIM_real();
+
+	qp = NULL;
+#ifdef WRK_AFFINITY
+	/* Back to where its data was last used */
+	if (params->wthread_affinity && wrq->pool > 0 && wrq->pool <= nwq)
+		qp = wq[wrq->pool - 1];
+#endif
+	if (qp == NULL) {
+		/*
+		 * Round robin.  Racing on nq only makes the spread a
+		 * little less even.
+		 * XXX: better alg ?
+		 */
+		onq = nq + 1;
+		if (onq >= nwq)
+			onq = 0;
+		qp = wq[onq];
+		nq = onq;
+	}
+	CHECK_OBJ_NOTNULL(qp, WQ_MAGIC);
+
+#ifdef WRK_LOCKFREE
+	if (lockfree)
+		return (wrk_lf_queue(qp, wrq));
+#endif
+
+	/* If there are idle threads, we tickle the first one into action */
+	if (wrk_tickle(qp, wrq, 0))
+		return (0);
+
+	/* Rather than queue it, let an idle thread in another pool have it */
+	n = nwq;
+	for (u = 1; u < n; u++) {
+		qp2 = wq[(qp->idx + u) % n];
+		CHECK_OBJ_NOTNULL(qp2, WQ_MAGIC);
+		if (VTAILQ_EMPTY(&qp2->idle))	/* Unlocked peek */
+			continue;
+		if (wrk_tickle(qp2, wrq, 1))
+			return (0);
+	}
+
+	/* Queue it, on another pool's overflow if ours is full */
+	for (u = 0; u < n; u++)
+		if (wrk_overflow(wq[(qp->idx + u) % n], wrq, u > 0))
+			return (0);
+
+	/* If all pools have too much in the overflow already, refuse. */
+	Lck_Lock(&qp->mtx);
+	qp->ndrop++;
+	Lck_Unlock(&qp->mtx);
+	return (-1);
 }
 
 /*--------------------------------------------------------------------*/
@@ -334,34 +966,127 @@ wrk_addpools(const unsigned pools)
 		wq[u] = calloc(sizeof *wq[u], 1);
 		XXXAN(wq[u]);
 		wq[u]->magic = WQ_MAGIC;
+		wq[u]->idx = u;
 		Lck_New(&wq[u]->mtx);
 		VTAILQ_INIT(&wq[u]->overflow);
 		VTAILQ_INIT(&wq[u]->idle);
+#ifdef WRK_LOCKFREE
+		if (lockfree)
+			wrk_lf_init(wq[u]);
+#endif
 	}
 	(void)owq;	/* XXX: avoid race, leak it. */
 	nwq = pools;
 }
 
+/*--------------------------------------------------------------------
+ * Find out how long work waited for a thread in a pool since last time,
+ * or how long the oldest queued request has waited, if that is longer.
+ * If that is over params->wthread_latency, work out how many threads
+ * the pool should have, at most twice as many as now, and get the
+ * herder going.
+ */
+
+static void
+wrk_pace_flock(struct wq *qp, double now, double *sumlat, unsigned *nlat)
+{
+	struct workreq *wrq;
+	double l, f;
+	unsigned n, u;
+
+	Lck_AssertHeld(&qp->mtx);
+	l = qp->sumlat;
+	n = qp->nlat;
+	qp->sumlat = 0.;
+	qp->nlat = 0;
+	*sumlat += l;
+	*nlat += n;
+	qp->lat = n > 0 ? l / n : 0.;
+	wrq = VTAILQ_FIRST(&qp->overflow);
+	if (wrq != NULL && now - wrq->t_queue > qp->lat)
+		qp->lat = now - wrq->t_queue;
+
+	qp->nwant = 0;
+	if (params->wthread_latency <= 0. || qp->lat <= params->wthread_latency)
+		return;
+	f = qp->lat / params->wthread_latency - 1.;
+	if (f > 1.)
+		f = 1.;
+	u = (unsigned)ceil(qp->nthr * f);
+	if (u == 0)
+		u = 1;
+	u += qp->nthr;
+	if (u > nthr_max)
+		u = nthr_max;
+	if (u <= qp->nthr)
+		return;
+	qp->nwant = u;
+	AZ(pthread_cond_signal(&herder_cond));
+}
+
+/*
+ * Is work waiting for so short a time that the pool can do with less?
+ * Only if it had threads to spare all through the last interval, else
+ * we would just have to start them again.
+ */
+
+static int
+wrk_slack_flock(const struct wq *qp)
+{
+
+	return (params->wthread_latency > 0. && qp->nwant == 0 &&
+	    qp->lat < params->wthread_latency * 0.5 && qp->minidle > 0);
+}
+
 /*--------------------------------------------------------------------
  * If a thread is idle or excess, pick it out of the pool.
  */
 
 static void
-wrk_decimate_flock(struct wq *qp, double t_idle, struct varnish_stats *vs)
+wrk_decimate_flock(struct wq *qp, double now, struct varnish_stats *vs,
+    double *sumlat, unsigned *nlat)
 {
+	double t_idle;
 	struct worker *w = NULL;
+#ifdef WRK_LOCKFREE
+	unsigned u;
+#endif
 
 	Lck_Lock(&qp->mtx);
 	vs->n_wrk += qp->nthr;
-	vs->n_wrk_queue += qp->nqueue;
+	vs->n_wrk_queue += wrk_nqueue(qp);
+	vs->n_wrk_idle += wrk_nidle_flock(qp);
 	vs->n_wrk_drop += qp->ndrop;
 	vs->n_wrk_overflow += qp->noverflow;
+	vs->n_wrk_steal += qp->nsteal;
+	wrk_pace_flock(qp, now, sumlat, nlat);
+
+	t_idle = now - params->wthread_timeout;
+	if (wrk_slack_flock(qp))
+		t_idle = now;
+	qp->minidle = wrk_nidle_flock(qp);
+
+#ifdef WRK_LOCKFREE
+	if (lockfree) {
+		/*
+		 * We do not know how long each thread has been idle, so
+		 * we go by how long since the pool last ran out of them.
+		 */
+		u = qp->nthr > params->wthread_min &&
+		    (qp->t_full < t_idle || qp->nthr > nthr_max);
+		Lck_Unlock(&qp->mtx);
+		if (u && wrk_lf_retire(qp))
+			TIM_sleep(params->wthread_purge_delay * 1e-3);
+		return;
+	}
+#endif
 
 	if (qp->nthr > params->wthread_min) {
 		w = VTAILQ_LAST(&qp->idle, workerhead);
-		if (w != NULL && (w->lastused < t_idle || qp->nthr > nthr_max))
+		if (w != NULL && (w->lastused < t_idle || qp->nthr > nthr_max)) {
 			VTAILQ_REMOVE(&qp->idle, w, list);
-		else
+			qp->minidle = --qp->lidle;
+		} else
 			w = NULL;
 	}
 	Lck_Unlock(&qp->mtx);
@@ -388,7 +1113,8 @@ static void *
 wrk_herdtimer_thread(void *priv)
 {
 	volatile unsigned u;
-	double t_idle;
+	double now, sumlat;
+	unsigned nlat;
 	struct varnish_stats vsm, *vs;
 
 	THR_SetName("wrk_herdtimer");
@@ -414,22 +1140,43 @@ wrk_herdtimer_thread(void *priv)
 
 		vs->n_wrk = 0;
 		vs->n_wrk_queue = 0;
+		vs->n_wrk_idle = 0;
 		vs->n_wrk_drop = 0;
 		vs->n_wrk_overflow = 0;
+		vs->n_wrk_steal = 0;
+		sumlat = 0.;
+		nlat = 0;
 
-		t_idle = TIM_real() - params->wthread_timeout;
+		now = TIM_real();
 		for (u = 0; u < nwq; u++)
-			wrk_decimate_flock(wq[u], t_idle, vs);
+			wrk_decimate_flock(wq[u], now, vs, &sumlat, &nlat);
 
 		VSL_stats->n_wrk= vs->n_wrk;
 		VSL_stats->n_wrk_queue = vs->n_wrk_queue;
+		VSL_stats->n_wrk_idle = vs->n_wrk_idle;
 		VSL_stats->n_wrk_drop = vs->n_wrk_drop;
 		VSL_stats->n_wrk_overflow = vs->n_wrk_overflow;
+		VSL_stats->n_wrk_steal = vs->n_wrk_steal;
+		/* No work in this interval, no waiting either */
+		VSL_stats->n_wrk_queue_latency =
+		    nlat > 0 ? (uint64_t)(1e6 * sumlat / nlat) : 0;
 
 		TIM_sleep(params->wthread_purge_delay * 1e-3);
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Does a pool need more threads right away ?
+ */
+
+static int
+wrk_short(const struct wq *qp)
+{
+
+	return (qp->nthr < params->wthread_min ||
+	    (qp->nthr < qp->nwant && qp->nthr < nthr_max));
+}
+
 /*--------------------------------------------------------------------
  * Create another thread, if necessary & possible
  */
@@ -438,17 +1185,28 @@ static void
 wrk_breed_flock(struct wq *qp)
 {
 	pthread_t tp;
+	pthread_attr_t tp_attr;
+	unsigned nqueue;
 
 	/*
 	 * If we need more threads, and have space, create
 	 * one more thread.
 	 */
-	if (qp->nthr < params->wthread_min ||	/* Not enough threads yet */
-	    (qp->nqueue > params->wthread_add_threshold && /* more needed */
-	    qp->nqueue > qp->lqueue)) {	/* not getting better since last */
+	nqueue = wrk_nqueue(qp);
+	if (wrk_short(qp) ||			/* Not enough threads yet */
+	    (nqueue > params->wthread_add_threshold && /* more needed */
+	    nqueue > qp->lqueue)) {	/* not getting better since last */
+		/*
+		 * Too small a stack for this platform leaves us with
+		 * the default, rather than no threads at all.
+		 */
+		AZ(pthread_attr_init(&tp_attr));
+		if (params->wthread_stacksize != UINT_MAX)
+			(void)pthread_attr_setstacksize(&tp_attr,
+			    params->wthread_stacksize);
 		if (qp->nthr >= nthr_max) {
 			VSL_stats->n_wrk_max++;
-		} else if (pthread_create(&tp, NULL, wrk_thread, qp)) {
+		} else if (pthread_create(&tp, &tp_attr, wrk_thread, qp)) {
 			VSL(SLT_Debug, 0, "Create worker thread failed %d %s",
 			    errno, strerror(errno));
 			VSL_stats->n_wrk_failed++;
@@ -458,8 +1216,9 @@ wrk_breed_flock(struct wq *qp)
 			VSL_stats->n_wrk_create++;
 			TIM_sleep(params->wthread_add_delay * 1e-3);
 		}
+		AZ(pthread_attr_destroy(&tp_attr));
 	}
-	qp->lqueue = qp->nqueue;
+	qp->lqueue = nqueue;
 }
 
 /*--------------------------------------------------------------------
@@ -485,10 +1244,11 @@ wrk_herder_thread(void *priv)
 	while (1) {
 		for (u = 0 ; u < nwq; u++) {
 			/*
-			 * Make sure all pools have their minimum complement
+			 * Make sure all pools have their minimum complement,
+			 * and as many as wrk_pace_flock() asked for.
 			 */
 			for (w = 0 ; w < nwq; w++)
-				while (wq[w]->nthr < params->wthread_min)
+				while (wrk_short(wq[w]))
 					wrk_breed_flock(wq[w]);
 			/*
 			 * We cannot avoid getting a mutex, so we have a
@@ -568,6 +1328,12 @@ WRK_Init(void)
 	Lck_New(&herder_mtx);
 	Lck_New(&wstat_mtx);
 
+#ifdef WRK_AFFINITY
+	wrk_cpu_init();
+#endif
+#ifdef WRK_LOCKFREE
+	lockfree = params->wthread_lockfree;
+#endif
 	wrk_addpools(params->wthread_pools);
 	AZ(pthread_create(&tp, NULL, wrk_herdtimer_thread, NULL));
 	AZ(pthread_detach(tp));
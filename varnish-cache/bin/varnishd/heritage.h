@@ -92,6 +92,10 @@ struct params {
 	unsigned		wthread_add_delay;
 	unsigned		wthread_fail_delay;
 	unsigned		wthread_purge_delay;
+	unsigned		wthread_affinity;
+	unsigned		wthread_lockfree;
+	double			wthread_latency;
+	unsigned		wthread_stacksize;
 
 	unsigned		overflow_max;
 
@@ -159,6 +163,12 @@ struct params {
 	double			first_byte_timeout;
 	double	 		between_bytes_timeout;
 
+	/* Close backend connections idle for longer than this */
+	double			backend_idle_timeout;
+
+	/* Look up backend addresses again this often */
+	double			backend_resolve_interval;
+
 	/* How long to linger on sessions */
 	unsigned		session_linger;
 
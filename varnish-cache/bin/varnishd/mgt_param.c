@@ -123,7 +123,7 @@ tweak_timeout(struct cli *cli, const struct parspec *par, const char *arg)
 	tweak_generic_timeout(cli, dest, arg);
 }
 
-static void
+void
 tweak_timeout_double(struct cli *cli, const struct parspec *par, const char *arg)
 {
 	volatile double *dest;
@@ -164,7 +164,7 @@ tweak_generic_bool(struct cli *cli, volatile unsigned *dest, const char *arg)
 
 /*--------------------------------------------------------------------*/
 
-static void
+void
 tweak_bool(struct cli *cli, const struct parspec *par, const char *arg)
 {
 	volatile unsigned *dest;
@@ -661,6 +661,24 @@ static const struct parspec input_parspec[] = {
 		"backend request. This parameter does not apply to pipe.",
 		0,
 		"60", "s" },
+	{ "backend_idle_timeout", tweak_timeout_double,
+		&master.backend_idle_timeout, 0, UINT_MAX,
+		"Close backend connections which have been idle for longer "
+		"than this, except for the .min_idle_connections of the "
+		"backend.  Connections the backend closes are closed right "
+		"away.  A value of 0 means they are kept until the backend "
+		"closes them.",
+		0,
+		"60", "s" },
+	{ "backend_resolve_interval", tweak_timeout_double,
+		&master.backend_resolve_interval, 0, UINT_MAX,
+		"Look up the addresses of the backends again this often, "
+		"and use the new ones if they changed.  The lookup can also "
+		"be done with the backend.resolve CLI command.  A value of 0 "
+		"means the addresses found when the VCL was compiled are "
+		"used until a new VCL is loaded.",
+		0,
+		"0", "s" },
 	{ "accept_fd_holdoff", tweak_timeout,
 		&master.accept_fd_holdoff, 0,  3600*1000,
 		"If we run out of file descriptors, the accept thread will "
@@ -674,7 +692,9 @@ static const struct parspec input_parspec[] = {
 		"10", "s" },
 	{ "prefer_ipv6", tweak_bool, &master.prefer_ipv6, 0, 0,
 		"Prefer IPv6 address when connecting to backends which "
-		"have both IPv4 and IPv6 addresses.",
+		"have both IPv4 and IPv6 addresses.\n"
+		"The other address is tried in parallel if the preferred "
+		"one has not connected after 250 milliseconds.",
 		0,
 		"off", "bool" },
 	{ "session_max", tweak_uint,
@@ -147,6 +147,26 @@ const struct parspec WRK_parspec[] = {
 		"thread pile-up.\n",
 		EXPERIMENTAL,
 		"20", "milliseconds" },
+	{ "thread_pool_queue_latency",
+		tweak_timeout_double, &master.wthread_latency, 0, 0,
+		"Target time for work to wait for a worker thread.\n"
+		"\n"
+		"When set, each pool measures how long work waits between "
+		"being queued and a thread starting on it.  Pools where "
+		"work waits longer than this get more threads, in "
+		"proportion to how far off they are, and pools where it "
+		"waits less than half of this, and which had idle threads "
+		"to spare for a whole thread_pool_purge_delay, retire those "
+		"without waiting for thread_pool_timeout.\n"
+		"\n"
+		"The measurements are taken every thread_pool_purge_delay, "
+		"and thread_pool_add_delay still applies between new "
+		"threads.\n"
+		"\n"
+		"A value of 0 leaves the pools sized by "
+		"thread_pool_add_threshold and thread_pool_timeout only.",
+		EXPERIMENTAL,
+		"0", "s" },
 	{ "thread_pool_fail_delay",
 		tweak_timeout, &master.wthread_fail_delay, 100, UINT_MAX,
 		"Wait at least this long after a failed thread creation "
@@ -165,6 +185,65 @@ const struct parspec WRK_parspec[] = {
 		"destroyed and later recreated.\n",
 		EXPERIMENTAL,
 		"200", "milliseconds" },
+	{ "thread_pool_affinity", tweak_bool, &master.wthread_affinity, 0, 0,
+		"Pin the threads of each pool to their own share of the "
+		"CPUs, and queue the work of a session to the pool whose "
+		"thread last ran it.\n"
+		"\n"
+		"This keeps session and workspace data in the caches, and "
+		"on NUMA machines the memory bank, of the CPUs which use "
+		"them.  The CPUs are divided between the pools in order, "
+		"so thread_pools should be a multiple of the number of "
+		"sockets, and no more than the number of CPUs.\n"
+		"\n"
+		"The acceptor and waiter threads are not pinned, so new "
+		"sessions are spread over the pools round robin, and a "
+		"session then stays with its pool for as long as it lives, "
+		"unless that pool is busy and an idle thread in another "
+		"pool takes its work.  The load on each pool therefore "
+		"follows the sessions it got, not the CPU which accepted "
+		"them.\n"
+		"\n"
+		"Only threads created after this is changed are affected, "
+		"so set it at startup.\n"
+		"\n"
+		"Has no effect on platforms without "
+		"pthread_setaffinity_np(3).",
+		EXPERIMENTAL | DELAYED_EFFECT,
+		"off", "bool" },
+	{ "thread_pool_lockfree", tweak_bool, &master.wthread_lockfree,
+		0, 0,
+		"Hand work to the threads through lock free queues, and "
+		"wake idle threads with a semaphore, rather than take the "
+		"pool's mutex and signal the thread's condition variable.\n"
+		"\n"
+		"This cuts the cost of handing off a session when the "
+		"pools are busy, but idle threads are woken in no "
+		"particular order, rather than the most recently used "
+		"first, and threads are only retired once their pool has "
+		"had idle threads for thread_pool_timeout.\n"
+		"\n"
+		"The queues are sized from thread_pool_max and overflow_max "
+		"when the pools are created.\n"
+		"\n"
+		"Has no effect on platforms without atomic builtins and "
+		"sem_init(3).",
+		EXPERIMENTAL | MUST_RESTART,
+		"off", "bool" },
+	{ "thread_pool_stack",
+		tweak_uint, &master.wthread_stacksize, 65536, UINT_MAX,
+		"Stack size of the worker threads.\n"
+		"\n"
+		"The workspaces are not on the stack, so it only has to "
+		"hold the call chain of a request, including VCL code and "
+		"any modules it calls.  Lowering this saves address space, "
+		"and memory for any part of the stack a thread ever "
+		"touched, when there are many threads.  Values below the "
+		"platform's minimum leave the system default.\n"
+		"\n"
+		"'unlimited' uses the system default.",
+		EXPERIMENTAL | DELAYED_EFFECT,
+		"unlimited", "bytes" },
 	{ "overflow_max", tweak_uint, &master.overflow_max, 0, UINT_MAX,
 		"Percentage permitted overflow queue length.\n"
 		"\n"
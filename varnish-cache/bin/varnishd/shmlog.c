@@ -66,6 +66,8 @@ struct varnish_stats *VSL_stats;
 static struct shmloghead *loghead;
 static unsigned char *logstart;
 static pthread_mutex_t vsl_mtx;
+static pthread_mutex_t vsl_dirstat_mtx;
+static struct varnish_dirstat vsl_dirstat_overflow;
 
 
 static void
@@ -304,6 +306,56 @@ VSL_Init(void)
 	loghead->starttime = TIM_real();
 	loghead->panicstr[0] = '\0';
 	memset(VSL_stats, 0, sizeof *VSL_stats);
+	memset(loghead->dirstats, 0, sizeof loghead->dirstats);
+	AZ(pthread_mutex_init(&vsl_dirstat_mtx, NULL));
+}
+
+/*--------------------------------------------------------------------
+ * Allocate and free slots for director member statistics.
+ *
+ * If the table is full, the counters go to a slot outside the shared
+ * memory, where nobody will ever see them.
+ */
+
+struct varnish_dirstat *
+VSL_DirStatNew(const char *director, const char *backend)
+{
+	struct varnish_dirstat *ds;
+	int i;
+
+	AN(director);
+	AN(backend);
+	AZ(pthread_mutex_lock(&vsl_dirstat_mtx));
+	ds = NULL;
+	for (i = 0; i < DIRSTAT_NSLOT; i++) {
+		if (loghead->dirstats[i].director[0] != '\0')
+			continue;
+		ds = &loghead->dirstats[i];
+		memset(ds, 0, sizeof *ds);
+		(void)snprintf(ds->backend, sizeof ds->backend, "%s",
+		    backend);
+		(void)snprintf(ds->director, sizeof ds->director, "%s",
+		    director);
+		if (ds->director[0] == '\0')
+			ds->director[0] = '-';
+		break;
+	}
+	AZ(pthread_mutex_unlock(&vsl_dirstat_mtx));
+	if (ds == NULL)
+		ds = &vsl_dirstat_overflow;
+	return (ds);
+}
+
+void
+VSL_DirStatDel(struct varnish_dirstat *ds)
+{
+
+	AN(ds);
+	if (ds == &vsl_dirstat_overflow)
+		return;
+	AZ(pthread_mutex_lock(&vsl_dirstat_mtx));
+	memset(ds, 0, sizeof *ds);
+	AZ(pthread_mutex_unlock(&vsl_dirstat_mtx));
 }
 
 /*--------------------------------------------------------------------*/
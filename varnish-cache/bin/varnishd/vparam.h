@@ -52,8 +52,11 @@ struct parspec {
 void tweak_generic_uint(struct cli *cli,
     volatile unsigned *dest, const char *arg, unsigned min, unsigned max);
 void tweak_uint(struct cli *cli, const struct parspec *par, const char *arg);
+void tweak_bool(struct cli *cli, const struct parspec *par, const char *arg);
 void tweak_timeout(struct cli *cli,
     const struct parspec *par, const char *arg);
+void tweak_timeout_double(struct cli *cli,
+    const struct parspec *par, const char *arg);
 
 extern struct params master;
 
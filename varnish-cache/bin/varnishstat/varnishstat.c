@@ -94,10 +94,14 @@ show_field(const char* field, const char *fields)
 }
 
 static void
-do_curses(struct varnish_stats *VSL_stats, int delay, const char *fields)
+do_curses(struct varnish_stats *VSL_stats,
+    const struct varnish_dirstat *dirstats, int delay, const char *fields)
 {
 	struct varnish_stats copy;
 	struct varnish_stats seen;
+	static struct varnish_dirstat dcopy[DIRSTAT_NSLOT];
+	const struct varnish_dirstat *ds;
+	int i;
 	intmax_t ju;
 	struct timeval tv;
 	double tt, lt, hit, miss, ratio, up;
@@ -166,6 +170,27 @@ do_curses(struct varnish_stats *VSL_stats, int delay, const char *fields)
 	}
 #include "stat_field.h"
 #undef MAC_STAT
+		for (i = 0; i < DIRSTAT_NSLOT; i++) {
+			ds = &dirstats[i];
+			if (ds->director[0] == '\0')
+				continue;
+#define MAC_DIRSTAT(n, t, f, d) \
+	if ((fields == NULL || show_field("dir_" #n, fields)) && \
+	    line < LINES) { \
+		ju = ds->n; \
+		line++; \
+		if (f == 'a') \
+			mvprintw(line, 0, "%12ju %12.2f %12.2f %s (%s.%s)\n", \
+			    ju, (ju - (intmax_t)dcopy[i].n)/lt, ju / up, d, \
+			    ds->director, ds->backend); \
+		else \
+			mvprintw(line, 0, "%12ju %12s %12s %s (%s.%s)\n", \
+			    ju, ".  ", ".  ", d, ds->director, ds->backend); \
+		dcopy[i].n = ju; \
+	}
+#include "stat_dir_field.h"
+#undef MAC_DIRSTAT
+		}
 		lt = tt;
 		refresh();
 		timeout(delay * 1000);
@@ -213,10 +238,13 @@ do_curses(struct varnish_stats *VSL_stats, int delay, const char *fields)
 }
 
 static void
-do_xml(struct varnish_stats *VSL_stats, const char* fields)
+do_xml(struct varnish_stats *VSL_stats,
+    const struct varnish_dirstat *dirstats, const char* fields)
 {
 	char time_stamp[20];
 	time_t now;
+	const struct varnish_dirstat *ds;
+	int i;
 
 	printf("<?xml version=\"1.0\"?>\n");
 	now = time(NULL);
@@ -234,14 +262,36 @@ do_xml(struct varnish_stats *VSL_stats, const char* fields)
 	} while (0);
 #include "stat_field.h"
 #undef MAC_STAT
+	for (i = 0; i < DIRSTAT_NSLOT; i++) {
+		ds = &dirstats[i];
+		if (ds->director[0] == '\0')
+			continue;
+#define MAC_DIRSTAT(n, t, f, d) \
+	do { \
+		if (fields != NULL && ! show_field("dir_" #n, fields)) break; \
+		intmax_t ju = ds->n; \
+		printf("\t<stat>\n"); \
+		printf("\t\t<name>%s</name>\n", "dir_" #n); \
+		printf("\t\t<director>%s</director>\n", ds->director); \
+		printf("\t\t<backend>%s</backend>\n", ds->backend); \
+		printf("\t\t<value>%ju</value>\n", ju); \
+		printf("\t\t<description>%s</description>\n", d); \
+		printf("\t</stat>\n"); \
+	} while (0);
+#include "stat_dir_field.h"
+#undef MAC_DIRSTAT
+	}
 	printf("</varnishstat>\n");
 }
 
 static void
-do_once(struct varnish_stats *VSL_stats, const char* fields)
+do_once(struct varnish_stats *VSL_stats,
+    const struct varnish_dirstat *dirstats, const char* fields)
 {
 	struct timeval tv;
 	double up;
+	const struct varnish_dirstat *ds;
+	int i;
 
 	gettimeofday(&tv, NULL);
 	up = tv.tv_sec - VSL_stats->start_time;
@@ -265,6 +315,25 @@ do_once(struct varnish_stats *VSL_stats, const char* fields)
 	} while (0);
 #include "stat_field.h"
 #undef MAC_STAT
+
+	for (i = 0; i < DIRSTAT_NSLOT; i++) {
+		ds = &dirstats[i];
+		if (ds->director[0] == '\0')
+			continue;
+#define MAC_DIRSTAT(n, t, f, d) \
+	do { \
+		if (fields != NULL && ! show_field("dir_" #n, fields)) break; \
+		intmax_t ju = ds->n; \
+		if (f == 'a') \
+			printf("%-16s %12ju %12.2f %s (%s.%s)\n", "dir_" #n, \
+			    ju, ju / up, d, ds->director, ds->backend); \
+		else \
+			printf("%-16s %12ju %12s %s (%s.%s)\n", "dir_" #n, \
+			    ju, ".  ", d, ds->director, ds->backend); \
+	} while (0);
+#include "stat_dir_field.h"
+#undef MAC_DIRSTAT
+	}
 }
 
 static void
@@ -305,6 +374,14 @@ list_fields(void)
 	} while (0);
 #include "stat_field.h"
 #undef MAC_STAT
+
+#define MAC_DIRSTAT(n, t, f, d) \
+	do { \
+		fprintf(stderr, "%-20s %s, per director member\n", \
+		    "dir_" #n, d);\
+	} while (0);
+#include "stat_dir_field.h"
+#undef MAC_DIRSTAT
 }
 
 static int
@@ -317,6 +394,10 @@ valid_fields(const char* fields)
 	#n,
 #include "stat_field.h"
 #undef MAC_STAT
+#define MAC_DIRSTAT(n, t, f, d) \
+	"dir_" #n,
+#include "stat_dir_field.h"
+#undef MAC_DIRSTAT
 	NULL };
 	const char *field_start, *field_end;
 
@@ -358,6 +439,7 @@ main(int argc, char **argv)
 {
 	int c;
 	struct varnish_stats *VSL_stats;
+	struct varnish_dirstat *dirstats;
 	int delay = 1, once = 0, xml = 0;
 	const char *n_arg = NULL;
 	const char *fields = NULL;
@@ -392,6 +474,8 @@ main(int argc, char **argv)
 
 	if ((VSL_stats = VSL_OpenStats(n_arg)) == NULL)
 		exit(1);
+	if ((dirstats = VSL_OpenDirStats(n_arg)) == NULL)
+		exit(1);
 
 	if (fields != NULL && !valid_fields(fields)) {
 		usage();
@@ -399,11 +483,11 @@ main(int argc, char **argv)
 	}
 	
 	if (xml) 
-		do_xml(VSL_stats, fields);
+		do_xml(VSL_stats, dirstats, fields);
 	else if (once)
-		do_once(VSL_stats, fields);
+		do_once(VSL_stats, dirstats, fields);
 	else
-		do_curses(VSL_stats, delay, fields);
+		do_curses(VSL_stats, dirstats, delay, fields);
 
 	exit(0);
 }
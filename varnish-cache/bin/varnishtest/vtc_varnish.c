@@ -66,6 +66,7 @@ struct varnish {
 	VTAILQ_ENTRY(varnish)	list;
 
 	struct varnish_stats	*stats;
+	struct varnish_dirstat	*dirstats;
 
 	struct vsb 		*args;
 	int			fds[4];
@@ -303,6 +304,7 @@ varnish_launch(struct varnish *v)
 	if (v->stats != NULL)
 		VSL_Close();
 	v->stats = VSL_OpenStats(v->workdir);
+	v->dirstats = VSL_OpenDirStats(v->workdir);
 }
 
 /**********************************************************************
@@ -501,6 +503,44 @@ varnish_vclbackend(struct varnish *v, const char *vcl)
 	vsb_delete(vsb2);
 }
 
+/**********************************************************************
+ * Look up a director member statistic, named as varnishstat shows it:
+ * "dir_select(director.backend)"
+ */
+
+static int
+varnish_dirstat(const struct varnish *v, const char *name, uint64_t *val)
+{
+	const struct varnish_dirstat *ds;
+	char buf[DIRSTAT_NAMELEN * 2 + 2];
+	const char *p, *q;
+	int i;
+
+	p = strchr(name, '(');
+	q = strchr(name, ')');
+	if (v->dirstats == NULL || p == NULL || q == NULL || q < p ||
+	    q - p > sizeof buf)
+		return (0);
+	for (i = 0; i < DIRSTAT_NSLOT; i++) {
+		ds = &v->dirstats[i];
+		if (ds->director[0] == '\0')
+			continue;
+		snprintf(buf, sizeof buf, "%s.%s", ds->director, ds->backend);
+		if (strlen(buf) != q - p - 1 || memcmp(buf, p + 1, q - p - 1))
+			continue;
+#define MAC_DIRSTAT(n, t, f, d)					\
+		if (!strncmp(name, "dir_" #n, p - name) &&	\
+		    p - name == sizeof "dir_" #n - 1) {		\
+			*val = ds->n;				\
+			return (1);				\
+		}
+#include "stat_dir_field.h"
+#undef MAC_DIRSTAT
+		return (0);
+	}
+	return (0);
+}
+
 /**********************************************************************
  * Check statistics
  */
@@ -524,8 +564,11 @@ varnish_expect(const struct varnish *v, char * const *av) {
 #include "stat_field.h"
 #undef MAC_STAT
 		{
-			val = 0;
-			vtc_log(v->vl, 0, "stats field %s unknown", av[0]);
+			if (!varnish_dirstat(v, av[0], &val)) {
+				val = 0;
+				vtc_log(v->vl, 0,
+				    "stats field %s unknown", av[0]);
+			}
 		}
 
 		ref = strtoumax(av[2], &p, 0);
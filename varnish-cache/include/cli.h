@@ -93,6 +93,17 @@
 	"\tReturns all metadata for the specified URL",			\
 	1, 1
 
+#define CLI_BACKEND_RESOLVE						\
+	"backend.resolve",						\
+	"backend.resolve [name [host]]",				\
+	"\tLook up the addresses of the backends, or those with the\n"	\
+	    "\tgiven name, again, and use the new ones if they changed.\n"	\
+	    "\tWith a host, look those backends up under that name\n"	\
+	    "\tfrom now on, instead of their .host.\n"			\
+	    "\tThe lookups are done in the background, the results\n"	\
+	    "\tare logged.",						\
+	0, 2
+
 #define CLI_VCL_LOAD							\
 	"vcl.load",							\
 	"vcl.load <configname> <filename>",				\
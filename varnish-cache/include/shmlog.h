@@ -43,7 +43,7 @@
 #include "stats.h"
 
 struct shmloghead {
-#define SHMLOGHEAD_MAGIC	4185512498U	/* From /dev/random */
+#define SHMLOGHEAD_MAGIC	566102308U	/* From /dev/random */
 	unsigned		magic;
 
 	unsigned		hdrsize;
@@ -66,6 +66,9 @@ struct shmloghead {
 
 	/* Panic message buffer */
 	char			panicstr[64 * 1024];
+
+	/* Per-member director statistics, see stat_dir_field.h */
+	struct varnish_dirstat	dirstats[DIRSTAT_NSLOT];
 };
 
 /*
@@ -0,0 +1,38 @@
+/*-
+ * Copyright (c) 2009 Alex Kritikos
+ * All rights reserved.
+ *
+ * Author: Alex Kritikos <alex.kritikos@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Per director member counters, see struct varnish_dirstat in stats.h
+ */
+
+MAC_DIRSTAT(select,	uint64_t, 'a', "Times selected")
+MAC_DIRSTAT(fail,	uint64_t, 'a', "Selected but no connection")
+MAC_DIRSTAT(inflight,	unsigned, 'i', "Connections in use")
+MAC_DIRSTAT(tie,	uint64_t, 'a', "Selected on a tie")
+MAC_DIRSTAT(unhealthy,	uint64_t, 'a', "Skipped as unhealthy")
+MAC_DIRSTAT(ejected,	uint64_t, 'a', "Skipped for too many errors")
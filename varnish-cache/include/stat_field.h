@@ -45,6 +45,18 @@ MAC_STAT(backend_fail,		uint64_t, 0, 'a', "Backend connections failures")
 MAC_STAT(backend_reuse,		uint64_t, 0, 'a', "Backend connections reuses")
 MAC_STAT(backend_recycle,	uint64_t, 0, 'a', "Backend connections recycles")
 MAC_STAT(backend_unused,	uint64_t, 0, 'a', "Backend connections unused")
+MAC_STAT(backend_idle_close,	uint64_t, 0, 'a',
+    "Backend connections closed while idle")
+MAC_STAT(backend_pipeline,	uint64_t, 0, 'a',
+    "Backend requests pipelined")
+MAC_STAT(backend_pipeline_retry,	uint64_t, 0, 'a',
+    "Backend requests resent after pipeline broke")
+MAC_STAT(backend_readdress,	uint64_t, 0, 'a',
+    "Backend addresses changed")
+MAC_STAT(backend_warm,		uint64_t, 0, 'a', "Backend connections pre-opened")
+MAC_STAT(backend_queue,		uint64_t, 0, 'a', "Backend requests queued")
+MAC_STAT(backend_queue_fail,	uint64_t, 0, 'a',
+    "Backend requests not queued or timed out")
 
 MAC_STAT(n_sess_mem,		uint64_t, 0, 'i', "N struct sess_mem")
 MAC_STAT(n_sess,		uint64_t, 0, 'i', "N struct sess")
@@ -61,7 +73,11 @@ MAC_STAT(n_wrk_max,		uint64_t, 0, 'a', "N worker threads limited")
 MAC_STAT(n_wrk_queue,		uint64_t, 0, 'a', "N queued work requests")
 MAC_STAT(n_wrk_overflow,	uint64_t, 0, 'a', "N overflowed work requests")
 MAC_STAT(n_wrk_drop,		uint64_t, 0, 'a', "N dropped work requests")
+MAC_STAT(n_wrk_steal,		uint64_t, 0, 'a', "N work requests taken by another pool")
+MAC_STAT(n_wrk_idle,		uint64_t, 0, 'i', "N idle worker threads")
+MAC_STAT(n_wrk_queue_latency,	uint64_t, 0, 'i', "Work request queue latency (us)")
 MAC_STAT(n_backend,		uint64_t, 0, 'i', "N backends")
+MAC_STAT(n_probe,		uint64_t, 0, 'i', "N backend probes")
 
 MAC_STAT(n_expired,		uint64_t, 0, 'i', "N expired objects")
 MAC_STAT(n_lru_nuked,		uint64_t, 0, 'i', "N LRU nuked objects")
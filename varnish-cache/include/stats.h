@@ -37,3 +37,20 @@ struct varnish_stats {
 #include "stat_field.h"
 #undef MAC_STAT
 };
+
+/*
+ * Directors which keep statistics for their members allocate a slot
+ * each in this table in the shared memory segment.  A slot is in use
+ * when its director name is not empty.
+ */
+
+#define DIRSTAT_NAMELEN		32
+#define DIRSTAT_NSLOT		256
+
+struct varnish_dirstat {
+	char			director[DIRSTAT_NAMELEN];
+	char			backend[DIRSTAT_NAMELEN];
+#define MAC_DIRSTAT(n, t, f, e)	t n;
+#include "stat_dir_field.h"
+#undef MAC_DIRSTAT
+};
@@ -59,6 +59,7 @@ int VSL_NextLog(struct VSL_data *lh, unsigned char **pp);
 int VSL_Arg(struct VSL_data *vd, int arg, const char *opt);
 void VSL_Close(void);
 struct varnish_stats *VSL_OpenStats(const char *varnish_name);
+struct varnish_dirstat *VSL_OpenDirStats(const char *varnish_name);
 const char *VSL_Name(void);
 extern const char *VSL_tags[256];
 
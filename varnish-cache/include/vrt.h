@@ -65,6 +65,10 @@ struct vrt_backend {
 
 	const char			*hosthdr;
 
+	/* The .host and .port, so the addresses can be looked up again */
+	const char			*hostname;
+	const char			*portname;
+
 	const unsigned char		*ipv4_sockaddr;
 	const unsigned char		*ipv6_sockaddr;
 
@@ -72,6 +76,8 @@ struct vrt_backend {
 	double				first_byte_timeout;
 	double				between_bytes_timeout;
 	unsigned			max_connections;
+	unsigned			min_idle_connections;
+	unsigned			pipeline_depth;
 	struct vrt_backend_probe	probe;
 };
 
@@ -120,14 +126,43 @@ struct vrt_dir_round_robin {
 
 struct vrt_dir_least_busy_entry {
 	const struct vrt_backend		*host;
+	double					weight;
 };
 
+#define VRT_LEAST_BUSY_SCAN	0	/* Examine all members */
+#define VRT_LEAST_BUSY_P2C	1	/* Best of two random members */
+#define VRT_LEAST_BUSY_LATENCY	2	/* Weigh by response time */
+
 struct vrt_dir_least_busy {
 	const char				*name;
+	unsigned				policy;
+	unsigned				retries;
+	unsigned				queue_length;
+	double					queue_timeout;
+	double					slow_start;
+	double					eject_threshold;
+	double					eject_time;
 	unsigned				nmember;
 	const struct vrt_dir_least_busy_entry	*members;
 };
 
+/*
+ * A director with consistent hashing and bounded load
+ */
+
+struct vrt_dir_hash_entry {
+	const struct vrt_backend		*host;
+	double					weight;
+};
+
+struct vrt_dir_hash {
+	const char				*name;
+	unsigned				retries;
+	double					load_factor;
+	unsigned				nmember;
+	const struct vrt_dir_hash_entry		*members;
+};
+
 /*
  * other stuff.
  * XXX: document when bored
@@ -186,6 +221,10 @@ void VRT_init_dir_random(struct cli *, struct director **,
     const struct vrt_dir_random *);
 void VRT_init_dir_round_robin(struct cli *, struct director **,
     const struct vrt_dir_round_robin *);
+void VRT_init_dir_least_busy(struct cli *, struct director **,
+    const struct vrt_dir_least_busy *);
+void VRT_init_dir_hash(struct cli *, struct director **,
+    const struct vrt_dir_hash *);
 void VRT_fini_dir(struct cli *, struct director *);
 
 char *VRT_IP_string(const struct sess *sp, const struct sockaddr *sa);
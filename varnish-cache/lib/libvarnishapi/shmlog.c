@@ -561,6 +561,15 @@ VSL_OpenStats(const char *varnish_name)
 	return (&vsl_lh->stats);
 }
 
+struct varnish_dirstat *
+VSL_OpenDirStats(const char *varnish_name)
+{
+
+	if (vsl_shmem_map(varnish_name))
+		return (NULL);
+	return (vsl_lh->dirstats);
+}
+
 void
 VSL_Close(void)
 {
@@ -478,6 +478,8 @@ vcc_ParseHostDef(struct tokenlist *tl, int *nbh, const struct token *name,
 	    "?between_bytes_timeout",
 	    "?probe",
 	    "?max_connections",
+	    "?min_idle_connections",
+	    "?pipeline_depth",
 	    NULL);
 	t_first = tl->t;
 
@@ -561,6 +563,20 @@ vcc_ParseHostDef(struct tokenlist *tl, int *nbh, const struct token *name,
 			ExpectErr(tl, ';');
 			vcc_NextToken(tl);
 			Fb(tl, 0, "\t.max_connections = %u,\n", u);
+		} else if (vcc_IdIs(t_field, "min_idle_connections")) {
+			u = vcc_UintVal(tl);
+			vcc_NextToken(tl);
+			ERRCHK(tl);
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+			Fb(tl, 0, "\t.min_idle_connections = %u,\n", u);
+		} else if (vcc_IdIs(t_field, "pipeline_depth")) {
+			u = vcc_UintVal(tl);
+			vcc_NextToken(tl);
+			ERRCHK(tl);
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+			Fb(tl, 0, "\t.pipeline_depth = %u,\n", u);
 		} else if (vcc_IdIs(t_field, "probe")) {
 			vcc_ParseProbe(tl);
 			ERRCHK(tl);
@@ -611,6 +627,17 @@ vcc_ParseHostDef(struct tokenlist *tl, int *nbh, const struct token *name,
 		EncToken(tl->fb, t_host);
 	Fb(tl, 0, ",\n");
 
+	/* Emit the host and port, for looking them up again at runtime */
+	Fb(tl, 0, "\t.hostname = ");
+	EncToken(tl->fb, t_host);
+	Fb(tl, 0, ",\n");
+	Fb(tl, 0, "\t.portname = ");
+	if (t_port != NULL)
+		EncToken(tl->fb, t_port);
+	else
+		Fb(tl, 0, "\"80\"");
+	Fb(tl, 0, ",\n");
+
 	/* Close the struct */
 	Fb(tl, 0, "};\n");
 
@@ -721,6 +748,7 @@ static const struct dirlist {
 	{ "random",		vcc_ParseRandomDirector },
 	{ "round-robin",	vcc_ParseRoundRobinDirector },
         { "least-busy",         vcc_ParseLeastBusyDirector },
+	{ "hash",		vcc_ParseHashDirector },
 	{ NULL,		NULL }
 };
 
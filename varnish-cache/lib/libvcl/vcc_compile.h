@@ -189,6 +189,9 @@ parsedirector_f vcc_ParseRoundRobinDirector;
 /* vcc_dir_least_busy.c */
 parsedirector_f vcc_ParseLeastBusyDirector;
 
+/* vcc_dir_hash.c */
+parsedirector_f vcc_ParseHashDirector;
+
 /* vcc_obj.c */
 extern struct var vcc_vars[];
 
@@ -53,12 +53,108 @@ void
 vcc_ParseLeastBusyDirector(struct tokenlist *tl, const struct token *t_policy,
     const struct token *t_dir)
 {
-	struct token *t_field, *t_be;
+	struct token *t_field, *t_be, *t_et;
 	int nbh, nelem;
-	struct fld_spec *fs;
-	const char *first;
+	struct fld_spec *fs, *mfs;
+	struct vsb *vsb;
+	unsigned u, retries, queue_length;
+	double eject_threshold;
+	const char *first, *policy;
 
-	fs = vcc_FldSpec(tl, "!backend", NULL);
+	fs = vcc_FldSpec(tl, "?policy", "?retries", "?queue_length",
+	    "?queue_timeout", "?slow_start", "?eject_threshold",
+	    "?eject_time", NULL);
+
+	policy = "VRT_LEAST_BUSY_SCAN";
+	retries = 0;
+	queue_length = 0;
+	eject_threshold = 0.0;
+
+	vsb = vsb_newauto();
+	AN(vsb);
+	tl->fb = vsb;
+
+	while (tl->t->tok != '{') {
+		vcc_IsField(tl, &t_field, fs);
+		ERRCHK(tl);
+		if (vcc_IdIs(t_field, "policy")) {
+			ExpectErr(tl, ID);
+			if (vcc_IdIs(tl->t, "scan")) {
+				policy = "VRT_LEAST_BUSY_SCAN";
+			} else if (vcc_IdIs(tl->t, "p2c")) {
+				policy = "VRT_LEAST_BUSY_P2C";
+			} else if (vcc_IdIs(tl->t, "latency")) {
+				policy = "VRT_LEAST_BUSY_LATENCY";
+			} else {
+				vsb_printf(tl->sb,
+				    "Unknown least-busy policy: ");
+				vcc_ErrToken(tl, tl->t);
+				vsb_printf(tl->sb, " at\n");
+				vcc_ErrWhere(tl, tl->t);
+				return;
+			}
+			vcc_NextToken(tl);
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+		} else if (vcc_IdIs(t_field, "retries")) {
+			ExpectErr(tl, CNUM);
+			retries = vcc_UintVal(tl);
+			ERRCHK(tl);
+			vcc_NextToken(tl);
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+		} else if (vcc_IdIs(t_field, "queue_length")) {
+			ExpectErr(tl, CNUM);
+			queue_length = vcc_UintVal(tl);
+			ERRCHK(tl);
+			vcc_NextToken(tl);
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+		} else if (vcc_IdIs(t_field, "queue_timeout")) {
+			Fb(tl, 0, "\t.queue_timeout = ");
+			vcc_TimeVal(tl);
+			ERRCHK(tl);
+			Fb(tl, 0, ",\n");
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+		} else if (vcc_IdIs(t_field, "eject_threshold")) {
+			ExpectErr(tl, CNUM);
+			t_et = tl->t;
+			eject_threshold = vcc_DoubleVal(tl);
+			ERRCHK(tl);
+			if (eject_threshold <= 0.0 || eject_threshold > 1.0) {
+				vsb_printf(tl->sb,
+				    "The .eject_threshold must be higher than"
+				    " zero and at most 1, at\n");
+				vcc_ErrWhere(tl, t_et);
+				return;
+			}
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+		} else if (vcc_IdIs(t_field, "eject_time")) {
+			Fb(tl, 0, "\t.eject_time = ");
+			vcc_TimeVal(tl);
+			ERRCHK(tl);
+			Fb(tl, 0, ",\n");
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+		} else if (vcc_IdIs(t_field, "slow_start")) {
+			Fb(tl, 0, "\t.slow_start = ");
+			vcc_TimeVal(tl);
+			ERRCHK(tl);
+			Fb(tl, 0, ",\n");
+			ExpectErr(tl, ';');
+			vcc_NextToken(tl);
+		} else {
+			ErrInternal(tl);
+		}
+	}
+
+	tl->fb = NULL;
+	vsb_finish(vsb);
+	AZ(vsb_overflowed(vsb));
+
+	mfs = vcc_FldSpec(tl, "!backend", "?weight", NULL);
 
 	Fc(tl, 0, "\nstatic const struct vrt_dir_least_busy_entry "
 	    "vdrre_%.*s[] = {\n", PF(t_dir));
@@ -66,7 +162,7 @@ vcc_ParseLeastBusyDirector(struct tokenlist *tl, const struct token *t_policy,
 	for (nelem = 0; tl->t->tok != '}'; nelem++) {	/* List of members */
 		first = "";
 		t_be = tl->t;
-		vcc_ResetFldSpec(fs);
+		vcc_ResetFldSpec(mfs);
 		nbh = -1;
 
 		ExpectErr(tl, '{');
@@ -74,19 +170,36 @@ vcc_ParseLeastBusyDirector(struct tokenlist *tl, const struct token *t_policy,
 		Fc(tl, 0, "\t{");
 
 		while (tl->t->tok != '}') {	/* Member fields */
-			vcc_IsField(tl, &t_field, fs);
+			vcc_IsField(tl, &t_field, mfs);
 			ERRCHK(tl);
 			if (vcc_IdIs(t_field, "backend")) {
 				vcc_ParseBackendHost(tl, &nbh,
 				    t_dir, t_policy, nelem);
 				Fc(tl, 0, "%s .host = &bh_%d", first, nbh);
 				ERRCHK(tl);
+			} else if (vcc_IdIs(t_field, "weight")) {
+				ExpectErr(tl, CNUM);
+				u = vcc_UintVal(tl);
+				ERRCHK(tl);
+				if (u == 0) {
+					vsb_printf(tl->sb,
+					    "The .weight must be higher "
+					    "than zero.");
+					vcc_ErrToken(tl, tl->t);
+					vsb_printf(tl->sb, " at\n");
+					vcc_ErrWhere(tl, tl->t);
+					return;
+				}
+				Fc(tl, 0, "%s .weight = %u", first, u);
+				vcc_NextToken(tl);
+				ExpectErr(tl, ';');
+				vcc_NextToken(tl);
 			} else {
 				ErrInternal(tl);
 			}
 			first = ", ";
 		}
-		vcc_FieldsOk(tl, fs);
+		vcc_FieldsOk(tl, mfs);
 		if (tl->err) {
 			vsb_printf(tl->sb,
 			    "\nIn member host specification starting at:\n");
@@ -101,6 +214,12 @@ vcc_ParseLeastBusyDirector(struct tokenlist *tl, const struct token *t_policy,
 	    "\nstatic const struct vrt_dir_least_busy vdrr_%.*s = {\n",
 	    PF(t_dir));
 	Fc(tl, 0, "\t.name = \"%.*s\",\n", PF(t_dir));
+	Fc(tl, 0, "\t.policy = %s,\n", policy);
+	Fc(tl, 0, "\t.retries = %u,\n", retries);
+	Fc(tl, 0, "\t.queue_length = %u,\n", queue_length);
+	Fc(tl, 0, "\t.eject_threshold = %g,\n", eject_threshold);
+	Fc(tl, 0, "%s", vsb_data(vsb));
+	vsb_delete(vsb);
 	Fc(tl, 0, "\t.nmember = %d,\n", nelem);
 	Fc(tl, 0, "\t.members = vdrre_%.*s,\n", PF(t_dir));
 	Fc(tl, 0, "};\n");
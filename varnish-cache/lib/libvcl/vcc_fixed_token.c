@@ -246,12 +246,17 @@ vcl_output_lang_h(struct vsb *sb)
 	vsb_cat(sb, " */\nstruct vrt_backend {\n\tconst char\t\t\t*vcl_name");
 	vsb_cat(sb, ";\n\tconst char\t\t\t*ident;\n\n");
 	vsb_cat(sb, "\tconst char\t\t\t*hosthdr;\n\n");
+	vsb_cat(sb, "\t/* The .host and .port, so the addresses can be look");
+	vsb_cat(sb, "ed up again */\n\tconst char\t\t\t*hostname;\n");
+	vsb_cat(sb, "\tconst char\t\t\t*portname;\n\n");
 	vsb_cat(sb, "\tconst unsigned char\t\t*ipv4_sockaddr;\n");
 	vsb_cat(sb, "\tconst unsigned char\t\t*ipv6_sockaddr;\n");
 	vsb_cat(sb, "\n\tdouble\t\t\t\tconnect_timeout;\n");
 	vsb_cat(sb, "\tdouble\t\t\t\tfirst_byte_timeout;\n");
 	vsb_cat(sb, "\tdouble\t\t\t\tbetween_bytes_timeout;\n");
 	vsb_cat(sb, "\tunsigned\t\t\tmax_connections;\n");
+	vsb_cat(sb, "\tunsigned\t\t\tmin_idle_connections;\n");
+	vsb_cat(sb, "\tunsigned\t\t\tpipeline_depth;\n");
 	vsb_cat(sb, "\tstruct vrt_backend_probe\tprobe;\n");
 	vsb_cat(sb, "};\n\n/*\n * A director with a predictable reply\n");
 	vsb_cat(sb, " */\n\nstruct vrt_dir_simple {\n");
@@ -272,9 +277,28 @@ vcl_output_lang_h(struct vsb *sb)
 	vsb_cat(sb, "};\n\n/*\n * A director with least-busy selection\n");
 	vsb_cat(sb, " */\n\nstruct vrt_dir_least_busy_entry {\n");
 	vsb_cat(sb, "\tconst struct vrt_backend\t\t*host;\n");
-	vsb_cat(sb, "};\n\nstruct vrt_dir_least_busy {\n");
-	vsb_cat(sb, "\tconst char\t\t\t\t*name;\n\tunsigned\t\t\t\tnmember;");
-	vsb_cat(sb, "\n\tconst struct vrt_dir_least_busy_entry\t*members;\n");
+	vsb_cat(sb, "\tdouble\t\t\t\t\tweight;\n};\n");
+	vsb_cat(sb, "\n#define VRT_LEAST_BUSY_SCAN\t0\t/* Examine all membe");
+	vsb_cat(sb, "rs */\n#define VRT_LEAST_BUSY_P2C\t1\t/* Best of two r");
+	vsb_cat(sb, "andom members */\n#define VRT_LEAST_BUSY_LATENCY\t2\t/");
+	vsb_cat(sb, "* Weigh by response time */\n\n");
+	vsb_cat(sb, "struct vrt_dir_least_busy {\n\tconst char\t\t\t\t*name");
+	vsb_cat(sb, ";\n\tunsigned\t\t\t\tpolicy;\n\tunsigned\t\t\t\tretrie");
+	vsb_cat(sb, "s;\n\tunsigned\t\t\t\tqueue_length;\n");
+	vsb_cat(sb, "\tdouble\t\t\t\t\tqueue_timeout;\n");
+	vsb_cat(sb, "\tdouble\t\t\t\t\tslow_start;\n");
+	vsb_cat(sb, "\tdouble\t\t\t\t\teject_threshold;\n");
+	vsb_cat(sb, "\tdouble\t\t\t\t\teject_time;\n");
+	vsb_cat(sb, "\tunsigned\t\t\t\tnmember;\n\tconst struct vrt_dir_lea");
+	vsb_cat(sb, "st_busy_entry\t*members;\n};\n\n");
+	vsb_cat(sb, "/*\n * A director with consistent hashing and bounded ");
+	vsb_cat(sb, "load\n */\n\nstruct vrt_dir_hash_entry {\n");
+	vsb_cat(sb, "\tconst struct vrt_backend\t\t*host;\n");
+	vsb_cat(sb, "\tdouble\t\t\t\t\tweight;\n};\n");
+	vsb_cat(sb, "\nstruct vrt_dir_hash {\n\tconst char\t\t\t\t*name;\n");
+	vsb_cat(sb, "\tunsigned\t\t\t\tretries;\n\tdouble\t\t\t\t\tload_fac");
+	vsb_cat(sb, "tor;\n\tunsigned\t\t\t\tnmember;\n");
+	vsb_cat(sb, "\tconst struct vrt_dir_hash_entry\t\t*members;\n");
 	vsb_cat(sb, "};\n\n/*\n * other stuff.\n * XXX: document when bored");
 	vsb_cat(sb, "\n */\n\nstruct vrt_ref {\n\tunsigned\tsource;\n");
 	vsb_cat(sb, "\tunsigned\toffset;\n\tunsigned\tline;\n");
@@ -313,6 +337,10 @@ vcl_output_lang_h(struct vsb *sb)
 	vsb_cat(sb, " **,\n    const struct vrt_dir_random *);\n");
 	vsb_cat(sb, "void VRT_init_dir_round_robin(struct cli *, struct dir");
 	vsb_cat(sb, "ector **,\n    const struct vrt_dir_round_robin *);\n");
+	vsb_cat(sb, "void VRT_init_dir_least_busy(struct cli *, struct dire");
+	vsb_cat(sb, "ctor **,\n    const struct vrt_dir_least_busy *);\n");
+	vsb_cat(sb, "void VRT_init_dir_hash(struct cli *, struct director *");
+	vsb_cat(sb, "*,\n    const struct vrt_dir_hash *);\n");
 	vsb_cat(sb, "void VRT_fini_dir(struct cli *, struct director *);\n");
 	vsb_cat(sb, "\nchar *VRT_IP_string(const struct sess *sp, const str");
 	vsb_cat(sb, "uct sockaddr *sa);\nchar *VRT_int_string(const struct ");